@@ -6,190 +6,1504 @@
 * License: BSD 3-clause License
 */
 
+#include <fstream>
 #include <iostream>
 #include <string>
+#include <cstdint>
 #include <regex>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <chrono>
 #include <iterator>
-#include <list>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <deque>
+#include <algorithm>
+#include <limits>
+#include "parser.h"
+#include "journal.h"
+#include "cron.h"
+#include "timer_core.h"
+#include "timer_export.h"
+#include "timer_service.h"
+#include "trace.h"
+#include "local_time.h"
 #include "znc/main.h"
 #include "znc/Modules.h"
 
 using namespace std;
 
-namespace parser
+// Which expiry backend a module uses unless overridden with the
+// "backend=thread|ctimer" load argument.
+#ifndef ALARM_DEFAULT_BACKEND
+#define ALARM_DEFAULT_BACKEND "thread"
+#endif
+
+// Which timer queue a module uses unless overridden with the
+// "engine=heap|wheel" load argument: a 4-ary heap, or a hierarchical timing
+// wheel, which keeps insert and expiry O(1) when there are many long
+// running timers.
+#ifndef ALARM_DEFAULT_ENGINE
+#define ALARM_DEFAULT_ENGINE "heap"
+#endif
+
+// How many timers a user may have running at once, unless changed with
+// the "limit" command. That is capped at the user's quota, which admins
+// can lower with the "quota" command and which is at most ALARM_MAX_LIMIT.
+#ifndef ALARM_DEFAULT_LIMIT
+#define ALARM_DEFAULT_LIMIT 1000u
+#endif
+#ifndef ALARM_MAX_LIMIT
+#define ALARM_MAX_LIMIT 100000u
+#endif
+
+// Counters behind the stats command, cheap enough to always be on.
+struct AlarmStats
 {
-auto secs_from_string ( const CString &sLine ) -> long long {
-    smatch match;
-    auto seconds = 0LL;
-
-    if ( regex_search ( sLine, match, regex("([0-9]{1,2})s")) )
-        seconds += stoll ( match[ 1 ] );
-    if ( regex_search ( sLine, match, regex("([0-9]{1,2})m") ) )
-        seconds += ( stoll ( match[ 1 ] ) * 60 );
-    if ( regex_search ( sLine, match, regex("([0-9]{1,2})h") ) )
-        seconds += ( stoll ( match[ 1 ] ) * 3600 );
-    if ( regex_search ( sLine, match, regex("([0-9]{1,3})d") ) )
-        seconds += ( stoll ( match[ 1 ] ) * 86400 );
-
-    return seconds;
-}
-auto string_from_secs ( const long long end_time ) -> string {
-    auto rest = end_time - time(0);
-    auto hours = rest / 3600;
-    rest = rest % 3600;
-    auto minutes = rest / 60;
-    rest = rest % 60;
-    auto seconds = rest;
-    std::string minutes_string, seconds_string;
-    if (minutes < 10)
-    {
-        minutes_string = "0" + to_string(minutes);
-    } else {
-        minutes_string = to_string(minutes);
-    }
-    if (seconds < 10)
-    {
-        seconds_string = "0" + to_string(seconds);
-    } else {
-        seconds_string = to_string(seconds);
-    }
-    auto temp = string{to_string(hours) + ":" + minutes_string + ":" + seconds_string};
-    return temp;
- }
-} // end of namespace parser
-
-class Timer
+    atomic<unsigned long long> adds { 0u };
+    atomic<unsigned long long> removes { 0u };
+    atomic<unsigned long long> expiries { 0u };
+    atomic<size_t> timers { 0u };
+    atomic<size_t> peak { 0u };
+    // Expiry lines that coalescing did not have to send.
+    atomic<unsigned long long> lines_saved { 0u };
+    DurationStat lock_wait;
+    DurationStat lock_hold;
+    DurationStat parse;
+
+    static void bump ( atomic<unsigned long long> &counter, unsigned long long n = 1u )
+    {
+        counter.fetch_add ( n, memory_order_relaxed );
+    }
+    // Only called by whoever holds the timers, so peak needs no CAS.
+    void set_timers ( size_t count )
+    {
+        timers.store ( count, memory_order_relaxed );
+        if ( count > peak.load ( memory_order_relaxed ) ) peak.store ( count, memory_order_relaxed );
+    }
+};
+
+// unique_lock that reports how long it waited for the mutex and how long
+// it then held it, to the stats and, while tracing, to the trace ring. A
+// default constructed one holds nothing.
+class TimedLock
 {
 public:
-    Timer ( const CString &sLine, unsigned int id ) 
+    TimedLock ( ) = default;
+    TimedLock ( mutex &m, AlarmStats &stats, TraceRing &trace ) : stats_ ( &stats )
     {
-        start_time_ = time ( 0 );
-        end_time_ = parser::secs_from_string(sLine) + start_time_;
-        const unsigned int reason_length = sLine.size() > REASON_LENGTH_MAX ? REASON_LENGTH_MAX : sLine.size() -1;
-        reason_ = sLine.substr ( 4, reason_length  );
-        this->timer_id_ = id;
+        const auto begin_ticks = trace.enabled ( ) ? trace_ticks ( ) : 0u;
+        const auto begin = Clock::now ( );
+        lock_ = unique_lock<mutex> ( m );
+        locked_at_ = Clock::now ( );
+        stats.lock_wait.record ( locked_at_ - begin );
+        if ( !trace.enabled ( ) ) return;
+        trace_ = &trace;
+        locked_ticks_ = trace_ticks ( );
+        trace.record ( TraceKind::lock_wait, begin_ticks ? begin_ticks : locked_ticks_, locked_ticks_, 0u );
     }
-    auto get_start_time  ( ) const -> long long
+    TimedLock ( TimedLock &&other )
+        : lock_ ( move ( other.lock_ ) ), stats_ ( other.stats_ ), locked_at_ ( other.locked_at_ ),
+          trace_ ( other.trace_ ), locked_ticks_ ( other.locked_ticks_ )
     {
-        return start_time_;
+        other.stats_ = nullptr;
+        other.trace_ = nullptr;
     }
-    auto get_end_time ( ) const -> long long
+    ~TimedLock ( )
     {
-        return end_time_;
+        if ( stats_ ) stats_->lock_hold.record ( Clock::now ( ) - locked_at_ );
+        if ( trace_ ) trace_->record ( TraceKind::lock_hold, locked_ticks_, trace_ticks ( ), 0u );
     }
-    auto timer_ran_out (  ) const -> bool
+
+private:
+    unique_lock<mutex> lock_;
+    AlarmStats *stats_ = nullptr;
+    Clock::time_point locked_at_;
+    TraceRing *trace_ = nullptr;
+    uint64_t locked_ticks_ = 0u;
+};
+
+// A change to a module's queue handed from a command to the scheduler.
+struct TimerRequest
+{
+    enum class Kind
     {
-        return time ( 0 ) >= end_time_;
+        add,
+        cancel,
+        snooze,      // expire delta from now
+        postpone     // expire delta later than it would have
+    };
+
+    Kind kind = Kind::add;
+    Timer timer;                 // add: its id is assigned when it is applied
+    unsigned id = 0u;            // cancel, snooze, postpone
+    Clock::duration delta { };   // snooze, postpone
+    string reply;                // add: sent once the timer is in the queue
+};
+
+class CAlarm;
+class CExpiryTimer;
+class CDeliveryTimer;
+class CReplyTimer;
+class CScheduleTimer;
+
+// Every loaded CAlarm, so that an admin's stats and quotas can cover all
+// users. Lock order is the registry's mutex_, then a module's.
+class ModuleRegistry
+{
+public:
+    static auto instance ( ) -> ModuleRegistry&
+    {
+        static ModuleRegistry registry;
+        return registry;
     }
-    auto get_timer ( ) const -> string
+    void add ( CAlarm *module )
     {
-        return reason_;
+        lock_guard<mutex> lock ( mutex_ );
+        modules_.insert ( module );
     }
-    auto get_id ( ) const -> unsigned
+    // Once this returns, for_each no longer visits module.
+    void remove ( CAlarm *module )
     {
-        return timer_id_;
+        lock_guard<mutex> lock ( mutex_ );
+        modules_.erase ( module );
     }
-    auto get_remaining_time ( ) const -> string
+    template <typename Visit>
+    void for_each ( Visit visit )
     {
-        return parser::string_from_secs(end_time_);
+        lock_guard<mutex> lock ( mutex_ );
+        for ( const auto *module : modules_ ) visit ( *module );
     }
+    // Calls visit on the module of the user named user, if it is loaded.
+    template <typename Visit>
+    auto with_user ( const string &user, Visit visit ) -> bool;
+
 private:
-    const unsigned REASON_LENGTH_MAX{128u};
-    long long start_time_ = 0LL;
-    long long end_time_ = 0LL;
-    unsigned timer_id_ = 0u;
-    string reason_ = "Default"s;
+    ModuleRegistry ( ) = default;
+
+    mutex mutex_{};
+    set<CAlarm*> modules_;
 };
 
-class CAlarm : public CModule
+class CAlarm : public CModule, public TimerClient
 {
 public:
     MODCONSTRUCTOR( CAlarm ) { }
+    // ZNC deletes expiry_timer_, dispatcher_, replier_ and scheduler_
+    // itself along with the module.
     virtual ~CAlarm ( ) override
     {
-        check_loop_ = false;
-        if (t1_.joinable()) t1_.join ( );
+        ModuleRegistry::instance ( ).remove ( this );
+        // ZNC deletes modules whose OnLoad failed too, which never attached.
+        if ( attached_ ) {
+            TimerService::instance ( ).detach ( this );
+            // Replies the service already queued are still sent; anything
+            // still queued goes into the journal, just without replies, and
+            // is flushed (or compacted) in one go.
+            detached_ = true;
+            put_replies ( );
+            drain_requests ( false );
+            // So that no cron timer is saved at its stand-in deadline.
+            refresh_cron ( );
+        }
+        // Expiries still inside the coalescing window or waiting for their
+        // network's flood budget are sent now rather than lost; ZNC's own
+        // send queue still paces the latter.
+        if ( !held_expired_.empty ( ) ) put_expired ( held_expired_ );
+        dispatch_deliveries ( true );
     }
     virtual bool OnLoad ( const CString &sArgs, CString &sMessage ) override
     {
+        auto backend = CString { ALARM_DEFAULT_BACKEND };
+        smatch match_backend;
+        if ( regex_search ( sArgs, match_backend, regex ( "backend=([a-z]+)" ) ) ) backend = match_backend[ 1 ].str ( );
+        if ( backend != "thread" && backend != "ctimer" ) {
+            sMessage = "Unknown backend '" + backend + "', use thread or ctimer.";
+            return false;
+        }
+        smatch match_engine;
+        if ( regex_search ( sArgs, match_engine, regex ( "engine=([a-z]+)" ) ) ) {
+            auto engine = make_timer_engine ( match_engine[ 1 ].str ( ) );
+            if ( !engine ) {
+                sMessage = "Unknown engine '" + match_engine[ 1 ].str ( ) + "', use heap or wheel.";
+                return false;
+            }
+            timers_ = move ( engine );
+            engine_ = match_engine[ 1 ].str ( );
+        }
+        threaded_ = backend == "thread";
         AddHelpCommand ( );
         AddCommand ( "add", static_cast<CModCommand::ModCmdFunc>(&CAlarm::add_timer), "reason",
                      "Add a timer with <reason>" );
         AddCommand ( "remove", static_cast<CModCommand::ModCmdFunc>(&CAlarm::remove_timer), "timer id",
                      "Remove a timer" );
-        AddCommand ( "list", static_cast<CModCommand::ModCmdFunc>(&CAlarm::list_timers), " ",
-                     "List all timers" );
-        t1_ = thread ( [ this ] ( ) {
-            loop_func ( );
+        AddCommand ( "repeat", static_cast<CModCommand::ModCmdFunc>(&CAlarm::repeat_timer), "reason",
+                     "Add a timer with <reason> that fires again every time its duration passes" );
+        AddCommand ( "snooze", static_cast<CModCommand::ModCmdFunc>(&CAlarm::snooze_timer), "<timer id> <duration>",
+                     "Let a timer expire <duration> from now instead" );
+        AddCommand ( "postpone", static_cast<CModCommand::ModCmdFunc>(&CAlarm::postpone_timer), "<timer id> <duration>",
+                     "Let a timer expire <duration> later than it would have" );
+        AddCommand ( "notify", static_cast<CModCommand::ModCmdFunc>(&CAlarm::notify_timer),
+                     "<network> <#channel or nick> reason",
+                     "Add a timer that is posted to a channel or nick on one of your networks" );
+        AddCommand ( "cron", static_cast<CModCommand::ModCmdFunc>(&CAlarm::cron_timer),
+                     "<minute> <hour> <day> <month> <weekday> reason",
+                     "Add a timer that fires on a cron schedule, e.g. cron 0 9 * * mon-fri standup" );
+        AddCommand ( "at", static_cast<CModCommand::ModCmdFunc>(&CAlarm::at_timer), "<YYYY-MM-DD> <HH:MM> reason",
+                     "Add a timer that expires at a date and time in your time zone" );
+        AddCommand ( "timezone", static_cast<CModCommand::ModCmdFunc>(&CAlarm::set_timezone), "[zone|default]",
+                     "Show or change the time zone of at and list, default is your ZNC user's" );
+        AddCommand ( "addmany", static_cast<CModCommand::ModCmdFunc>(&CAlarm::add_many), "reason; reason; ...",
+                     "Add several timers at once, separated by ;" );
+        AddCommand ( "removemany", static_cast<CModCommand::ModCmdFunc>(&CAlarm::remove_many), "timer id ...",
+                     "Remove several timers at once" );
+        AddCommand ( "list", static_cast<CModCommand::ModCmdFunc>(&CAlarm::list_timers), "[offset] [count]",
+                     "List your timers, " + to_string ( LIST_PAGE_DEFAULT ) + " at a time" );
+        AddCommand ( "latency", static_cast<CModCommand::ModCmdFunc>(&CAlarm::show_latency), " ",
+                     "Show how late timers were delivered" );
+        AddCommand ( "limit", static_cast<CModCommand::ModCmdFunc>(&CAlarm::set_limit), "[count]",
+                     "Show or change how many timers you may have running" );
+        AddCommand ( "quota", static_cast<CModCommand::ModCmdFunc>(&CAlarm::set_quota), "[user] [count]",
+                     "Show your quota, for admins show or change a user's" );
+        AddCommand ( "coalesce", static_cast<CModCommand::ModCmdFunc>(&CAlarm::set_coalesce), "[duration]",
+                     "Show or change how long expiries are collected before being announced together" );
+        AddCommand ( "stats", static_cast<CModCommand::ModCmdFunc>(&CAlarm::show_stats), " ",
+                     "Show counters about this module, for admins about every user's" );
+        AddCommand ( "export", static_cast<CModCommand::ModCmdFunc>(&CAlarm::export_command), "json|csv",
+                     "Write all your timers to timers.json or timers.csv" );
+        AddCommand ( "trace", static_cast<CModCommand::ModCmdFunc>(&CAlarm::trace_command), "on|off|dump",
+                     "Record timings of this module's hot paths, dump writes them to trace.log" );
+        const auto saved_quota = GetNV ( "quota" ).ToUInt ( );
+        if ( saved_quota > 0 ) timer_quota_ = min ( saved_quota, ALARM_MAX_LIMIT );
+        const auto saved_limit = GetNV ( "limit" ).ToUInt ( );
+        if ( saved_limit > 0 ) timer_limit_ = saved_limit;
+        timer_limit_ = min ( timer_limit_, timer_quota_ );
+        const auto saved_window = GetNV ( "coalesce" ).ToUInt ( );
+        if ( saved_window <= COALESCE_MAX_MS ) coalesce_window_ = chrono::milliseconds ( saved_window );
+        if ( !load_timers ( ) ) sMessage = "Could not open the timer journal, timers won't survive a restart.";
+        loaded_at_ = Clock::now ( );
+        user_name_ = GetUser ( )->GetUserName ( );
+        ModuleRegistry::instance ( ).add ( this );
+        if ( threaded_ ) {
+            TimerService::instance ( ).attach ( this );
+            attached_ = true;
+        }
+        // Fires what ran out while we were not loaded, all in one batch, and
+        // arms the backend for the rest. The service has nothing scheduled
+        // for us before this, so it can't take a part of the backlog first.
+        expire_timers ( numeric_limits<size_t>::max ( ) );
+        return true;
+    }
+    virtual CString GetWebMenuTitle ( ) override
+    {
+        return "Timers";
+    }
+    // timers.json and timers.csv are streamed from the list snapshot
+    // straight into the socket's send buffer, without a template.
+    virtual bool OnWebPreRequest ( CWebSock &WebSock, const CString &sPageName ) override
+    {
+        ExportFormat format;
+        if ( sPageName != "timers.json" && sPageName != "timers.csv" ) return false;
+        parse_export_format ( sPageName.substr ( 7 ), format );
+        const auto snapshot = list_snapshot ( );
+        WebSock.PrintHeader ( 0, export_content_type ( format ) );
+        export_timers ( *snapshot, Clock::now ( ), time ( 0 ), format, [ &WebSock ] ( const char *data, size_t length ) {
+            WebSock.Write ( data, length );
         } );
+        WebSock.Close ( CWebSock::CLT_AFTERWRITE );
+        return true;
+    }
+    // The index page shows the first LIST_PAGE_MAX timers and links the
+    // exports, which have all of them.
+    virtual bool OnWebRequest ( CWebSock &WebSock, const CString &sPageName, CTemplate &Tmpl ) override
+    {
+        if ( sPageName != "index" ) return false;
+        const auto snapshot = list_snapshot ( );
+        const auto now = Clock::now ( );
+        prepare_expiry_texts ( now, snapshot->size ( ) );
+        const auto zone = time_zone ( );
+        const auto shown = snapshot->size ( ) < LIST_PAGE_MAX ? snapshot->size ( ) : LIST_PAGE_MAX;
+        Tmpl[ "Count" ] = CString ( snapshot->size ( ) );
+        Tmpl[ "Shown" ] = CString ( shown );
+        if ( shown < snapshot->size ( ) ) Tmpl[ "Truncated" ] = "true";
+        char remaining[ 32 ];
+        for ( size_t i = 0; i < shown; ++i ) {
+            const auto &timer = ( *snapshot )[ i ];
+            const auto left = seconds_until ( timer.get_deadline ( ), now );
+            auto &row = Tmpl.AddRow ( "TimerLoop" );
+            row[ "Id" ] = CString ( timer.get_id ( ) );
+            row[ "ExpiresIn" ] = CString ( remaining, parser::format_hms ( left, remaining, sizeof remaining ) );
+            row[ "At" ] = expiry_text ( timer, zone );
+            if ( timer.get_cron ( ).valid ( ) ) {
+                row[ "Repeats" ] = "cron " + timer.get_cron ( ).to_string ( );
+            } else if ( timer.is_recurring ( ) ) {
+                const auto every = seconds_until ( now + timer.get_interval ( ), now );
+                row[ "Repeats" ] = "every " + string ( remaining, parser::format_hms ( every, remaining, sizeof remaining ) );
+            }
+            if ( timer.has_target ( ) ) row[ "Target" ] = timer.get_channel ( ) + " on " + timer.get_network ( );
+            row[ "Reason" ] = timer.get_timer ( );
+        }
         return true;
     }
     void add_timer ( const CString &sLine )
     {
-        lock_guard<mutex> lock ( mutex_ );
-        if ( timer_list_.size ( ) >= timer_limit_ ) {
-            PutModule ( "Too many timers running, can't create a new one." );
+        ALARM_TRACE_SCOPE ( trace_, add, 0u );
+        const auto duration = parse_duration ( sLine );
+        if ( duration.error != parser::ParseError::none ) {
+            PutModule ( parser::error_message ( duration.error ) );
             return;
         }
-        timer_list_.emplace_back ( sLine, ++timer_id_ );
-        sort_timers();
-        PutModule("Timer added.");
+        const auto reason = parser::skip_words ( sLine.data ( ), sLine.size ( ), 1 );
+        submit_add ( "Timer added.", [ & ] ( Timer &timer ) {
+            timer.reset ( sLine.data ( ) + reason, sLine.size ( ) - reason, chrono::milliseconds ( duration.milliseconds ), 0u );
+        } );
     }
-    void sort_timers ()
+    void repeat_timer ( const CString &sLine )
     {
-        timer_list_.sort([]( Timer a, Timer b) {
-            return a.get_end_time() < b.get_end_time();
-        });
+        const auto duration = parse_duration ( sLine );
+        if ( duration.error != parser::ParseError::none ) {
+            PutModule ( parser::error_message ( duration.error ) );
+            return;
+        }
+        const auto interval = chrono::milliseconds ( duration.milliseconds );
+        if ( interval < chrono::seconds ( 1 ) ) {
+            PutModule ( "Recurring timers must repeat at most once per second." );
+            return;
+        }
+        const auto reason = parser::skip_words ( sLine.data ( ), sLine.size ( ), 1 );
+        submit_add ( "Recurring timer added, remove it to stop it.", [ & ] ( Timer &timer ) {
+            timer.reset ( sLine.data ( ) + reason, sLine.size ( ) - reason, interval, 0u, interval );
+        } );
+    }
+    void notify_timer ( const CString &sLine )
+    {
+        const auto network = sLine.Token ( 1 );
+        const auto channel = sLine.Token ( 2 );
+        if ( channel.empty ( ) || !GetUser ( )->FindNetwork ( network ) ) {
+            PutModule ( "Give one of your networks and a channel or nick, e.g. notify libera #chan 5m standup." );
+            return;
+        }
+        const auto reason = parser::skip_words ( sLine.data ( ), sLine.size ( ), 3 );
+        const auto duration = parse_duration ( sLine.data ( ) + reason, sLine.size ( ) - reason );
+        if ( duration.error != parser::ParseError::none ) {
+            PutModule ( parser::error_message ( duration.error ) );
+            return;
+        }
+        if ( !Timer::target_fits ( network, channel ) ) {
+            PutModule ( "Network or channel name too long." );
+            return;
+        }
+        start_dispatcher ( );
+        submit_add ( "Timer added, it will be posted to " + channel + " on " + network + ".", [ & ] ( Timer &timer ) {
+            timer.reset ( sLine.data ( ) + reason, sLine.size ( ) - reason, chrono::milliseconds ( duration.milliseconds ), 0u );
+            timer.set_target ( network, channel );
+        } );
     }
     void remove_timer ( const CString &sLine )
     {
-        smatch match_id;
-        unsigned int id { timer_limit_ };
-        regex idReg { "([0-9]{1,5})" };
-        if ( regex_search ( sLine, match_id, idReg ) ) id = stoi ( match_id[ 1 ] );
-        lock_guard<mutex> lock ( mutex_ );
-        for ( auto vecIt = timer_list_.begin(); vecIt != timer_list_.end(); vecIt++ ) {
-            if ( id == vecIt->get_id() ) {
-                timer_list_.erase(vecIt);
-                PutModule("Removed the timer.\n");
-                return;
+        ALARM_TRACE_SCOPE ( trace_, remove, 0u );
+        const auto id = parser::parse_id ( sLine );
+        submit ( [ id ] ( TimerRequest &request ) {
+            request.kind = TimerRequest::Kind::cancel;
+            request.id = id;
+        } );
+    }
+    void snooze_timer ( const CString &sLine )
+    {
+        move_timer ( sLine, TimerRequest::Kind::snooze );
+    }
+    void postpone_timer ( const CString &sLine )
+    {
+        move_timer ( sLine, TimerRequest::Kind::postpone );
+    }
+    void move_timer ( const CString &sLine, TimerRequest::Kind kind )
+    {
+        const auto id = parser::parse_id ( sLine.Token ( 1 ) );
+        const auto rest = parser::skip_words ( sLine.data ( ), sLine.size ( ), 2 );
+        const auto duration = parse_duration ( sLine.data ( ) + rest, sLine.size ( ) - rest );
+        if ( id == 0u || duration.error != parser::ParseError::none ) {
+            PutModule ( id == 0u ? "Give the id of the timer, e.g. " + sLine.Token ( 0 ) + " 3 10m."
+                                 : parser::error_message ( duration.error ) );
+            return;
+        }
+        submit ( [ & ] ( TimerRequest &request ) {
+            request.kind = kind;
+            request.id = id;
+            request.delta = chrono::milliseconds ( duration.milliseconds );
+        } );
+    }
+    void cron_timer ( const CString &sLine )
+    {
+        const string text = sLine.Token ( 1, true );
+        CronSchedule cron;
+        size_t consumed = 0u;
+        if ( !cron.parse ( text, consumed ) ) {
+            PutModule ( "Invalid schedule, use <minute> <hour> <day> <month> <weekday> like cron does." );
+            return;
+        }
+        const auto wall_now = time ( 0 );
+        const auto first = cron.next_fire ( wall_now );
+        if ( first == 0 ) {
+            PutModule ( "That schedule never fires." );
+            return;
+        }
+        const auto reason = CString ( text.substr ( consumed ) ).Trim_n ( );
+        submit_add ( "Scheduled timer added, it first fires in " + parser::string_from_secs ( first ) + ".", [ & ] ( Timer &timer ) {
+            timer.reset ( reason.data ( ), reason.size ( ), chrono::seconds ( first - wall_now ), 0u );
+            timer.set_cron ( cron );
+            timer.set_cron_deferred ( threaded_ );
+        } );
+    }
+    void at_timer ( const CString &sLine )
+    {
+        const auto date = parser::skip_words ( sLine.data ( ), sLine.size ( ), 1 );
+        tm at;
+        const auto zone = time_zone ( );
+        const auto when = parser::parse_datetime ( sLine.data ( ) + date, sLine.size ( ) - date, at )
+                          ? local_time::to_epoch ( at, zone ) : -1;
+        if ( when == -1 ) {
+            PutModule ( "Give a date and time that exists in your time zone, e.g. at 2026-10-15 08:00 standup." );
+            return;
+        }
+        const auto wall_now = time ( 0 );
+        if ( when <= wall_now ) {
+            PutModule ( "That time has already passed." );
+            return;
+        }
+        if ( when - wall_now > parser::DURATION_MAX / 1000 ) {
+            PutModule ( parser::error_message ( parser::ParseError::out_of_range ) );
+            return;
+        }
+        const auto reason = parser::skip_words ( sLine.data ( ), sLine.size ( ), 3 );
+        submit_add ( "Timer added for " + local_time::format ( when, zone, "%Y-%m-%d %H:%M %Z" ) + ", it expires in " +
+                     parser::string_from_secs ( when ) + ".", [ & ] ( Timer &timer ) {
+            timer.reset ( sLine.data ( ) + reason, sLine.size ( ) - reason, chrono::seconds ( when - wall_now ), 0u );
+        } );
+    }
+    void set_timezone ( const CString &sLine )
+    {
+        const auto zone = sLine.Token ( 1 );
+        // libc quietly takes an unknown zone for UTC, so only the names
+        // ZNC offers for its own users' settings are accepted.
+        if ( !zone.empty ( ) && zone != "default" && CUtils::GetTimezones ( ).count ( zone ) == 0 ) {
+            PutModule ( "Unknown time zone '" + zone + "', use a name like Europe/Berlin or default." );
+            return;
+        }
+        if ( zone == "default" )
+            DelNV ( "timezone" );
+        else if ( !zone.empty ( ) )
+            SetNV ( "timezone", zone );
+        if ( !zone.empty ( ) ) expiry_texts_.clear ( );
+        const auto current = time_zone ( );
+        PutModule ( "Times are shown in " + ( current.empty ( ) ? string ( "the server's time zone" ) : current ) +
+                    ", where it is " + local_time::format ( time ( 0 ), current, "%Y-%m-%d %H:%M %Z" ) + " now." );
+    }
+    // Everything is parsed before taking the lock; the timers are then
+    // inserted under one lock with a single reschedule and one reply.
+    void add_many ( const CString &sLine )
+    {
+        vector<Timer> parsed;
+        size_t invalid = 0u;
+        const auto entries = sLine.Token ( 1, true );
+        for ( size_t begin = 0; begin < entries.size ( ); ) {
+            auto end = entries.find ( ';', begin );
+            if ( end == string::npos ) end = entries.size ( );
+            const auto first = entries.find_first_not_of ( ' ', begin );
+            if ( first < end ) {
+                const auto last = entries.find_last_not_of ( ' ', end - 1 );
+                const auto reason = entries.substr ( first, last + 1 - first );
+                const auto duration = parse_duration ( reason );
+                if ( duration.error == parser::ParseError::none )
+                    parsed.emplace_back ( reason, chrono::milliseconds ( duration.milliseconds ), 0u );
+                else
+                    ++invalid;
             }
+            begin = end + 1;
         }
-        PutModule ( "Timer doesn't exist.\n" );
+        size_t added = 0u;
+        unsigned first_id = 0u;
+        {
+            auto lock = lock_timers ( );
+            const auto old_front = next_deadline ( );
+            for ( auto &timer : parsed ) {
+                if ( timers_->size ( ) >= timer_limit_ ) break;
+                timer.set_id ( ++timer_id_ );
+                if ( first_id == 0u ) first_id = timer_id_;
+                queue_timer ( timer );
+                journal_added ( timer );
+                ++added;
+            }
+            AlarmStats::bump ( stats_.adds, added );
+            journal_commit ( );
+            if ( next_deadline ( ) != old_front ) reschedule ( );
+        }
+        auto reply = "Added " + to_string ( added ) + " timer(s)";
+        if ( added > 0 ) reply += " (ids " + to_string ( first_id ) + "-" + to_string ( first_id + added - 1 ) + ")";
+        if ( invalid > 0 ) reply += ", " + to_string ( invalid ) + " without a valid duration";
+        if ( added < parsed.size ( ) )
+            reply += ", " + to_string ( parsed.size ( ) - added ) + " over the limit";
+        PutModule ( reply + "." );
+    }
+    void remove_many ( const CString &sLine )
+    {
+        const auto ids = parser::parse_ids ( sLine );
+        size_t removed = 0u;
+        {
+            auto lock = lock_timers ( );
+            const auto old_front = next_deadline ( );
+            for ( const auto id : ids ) {
+                if ( !unqueue_timer ( id ) ) continue;
+                journal_.removed ( id );
+                ++removed;
+            }
+            AlarmStats::bump ( stats_.removes, removed );
+            journal_commit ( );
+            if ( next_deadline ( ) != old_front ) reschedule ( );
+        }
+        auto reply = "Removed " + to_string ( removed ) + " timer(s)";
+        if ( removed < ids.size ( ) ) reply += ", " + to_string ( ids.size ( ) - removed ) + " didn't exist";
+        PutModule ( reply + "." );
     }
+    void show_latency ( const CString &sLine )
+    {
+        LatencyHistogram histogram;
+        {
+            auto lock = lock_timers ( );
+            histogram = lateness_;
+        }
+        if ( histogram.count ( ) == 0 ) {
+            PutModule ( "No timers have expired yet." );
+            return;
+        }
+        char line[ 128 ];
+        snprintf ( line, sizeof line, "%llu deliveries, lateness p50 %.3fms, p99 %.3fms, max %.3fms",
+                   histogram.count ( ), histogram.percentile_us ( 50 ) / 1000.0,
+                   histogram.percentile_us ( 99 ) / 1000.0, histogram.max_us ( ) / 1000.0 );
+        PutModule ( line );
+        for ( size_t bucket = 0; bucket < LatencyHistogram::BUCKETS; ++bucket ) {
+            if ( histogram.bucket ( bucket ) == 0 ) continue;
+            snprintf ( line, sizeof line, "  <= %10.3fms: %llu", ( 1LL << bucket ) / 1000.0, histogram.bucket ( bucket ) );
+            PutModule ( line );
+        }
+    }
+    void show_stats ( const CString &sLine )
+    {
+        LatencyHistogram lateness;
+        unsigned limit;
+        long long window_ms;
+        {
+            auto lock = lock_timers ( );
+            lateness = lateness_;
+            limit = timer_limit_;
+            window_ms = chrono::duration_cast<chrono::milliseconds> ( coalesce_window_ ).count ( );
+        }
+        const auto uptime = Clock::now ( ) - loaded_at_;
+        const auto minutes = max ( 1.0 / 60, chrono::duration<double, ratio<60>> ( uptime ).count ( ) );
+        char since[ 32 ];
+        parser::format_hms ( chrono::duration_cast<chrono::seconds> ( uptime ).count ( ), since, sizeof since );
+        const auto adds = stats_.adds.load ( memory_order_relaxed );
+        const auto removes = stats_.removes.load ( memory_order_relaxed );
+        const auto expiries = stats_.expiries.load ( memory_order_relaxed );
+
+        char line[ 192 ];
+        snprintf ( line, sizeof line, "Timers: %zu running, peak %zu, limit %u, %s engine",
+                   stats_.timers.load ( memory_order_relaxed ), stats_.peak.load ( memory_order_relaxed ), limit,
+                   engine_.c_str ( ) );
+        PutModule ( line );
+        snprintf ( line, sizeof line, "In the %s since loading: %llu added (%.1f/min), %llu removed (%.1f/min), "
+                   "%llu expired (%.1f/min)", since, adds, adds / minutes, removes, removes / minutes,
+                   expiries, expiries / minutes );
+        PutModule ( line );
+        snprintf ( line, sizeof line, "Lateness: p50 %.3fms, p99 %.3fms, max %.3fms",
+                   lateness.percentile_us ( 50 ) / 1000.0, lateness.percentile_us ( 99 ) / 1000.0,
+                   lateness.max_us ( ) / 1000.0 );
+        PutModule ( line );
+        snprintf ( line, sizeof line, "Coalescing: %lldms window, %llu expiry lines saved", window_ms,
+                   stats_.lines_saved.load ( memory_order_relaxed ) );
+        PutModule ( line );
+        if ( threaded_ ) {
+            snprintf ( line, sizeof line, "Lock: %llu times, wait avg %.1fus max %.1fus, held avg %.1fus max %.1fus",
+                       stats_.lock_wait.count ( ), stats_.lock_wait.mean_us ( ), stats_.lock_wait.max_us ( ),
+                       stats_.lock_hold.mean_us ( ), stats_.lock_hold.max_us ( ) );
+            PutModule ( line );
+        }
+        snprintf ( line, sizeof line, "Parsing: %llu durations, avg %.3fus, max %.3fus", stats_.parse.count ( ),
+                   stats_.parse.mean_us ( ), stats_.parse.max_us ( ) );
+        PutModule ( line );
+        if ( !GetUser ( )->IsAdmin ( ) ) return;
+        vector<string> users;
+        ModuleRegistry::instance ( ).for_each ( [ &users, &line ] ( const CAlarm &module ) {
+            const auto &stats = module.stats_;
+            snprintf ( line, sizeof line, "  %s: %zu running, peak %zu, %llu added, %llu expired",
+                       module.user_name_.c_str ( ), stats.timers.load ( memory_order_relaxed ),
+                       stats.peak.load ( memory_order_relaxed ), stats.adds.load ( memory_order_relaxed ),
+                       stats.expiries.load ( memory_order_relaxed ) );
+            users.push_back ( line );
+        } );
+        PutModule ( "Per user:" );
+        for ( const auto &user : users ) PutModule ( user );
+    }
+    void set_limit ( const CString &sLine )
+    {
+        const auto arg = sLine.Token ( 1 );
+        if ( arg.empty ( ) ) {
+            PutModule ( "You may have up to " + to_string ( timer_limit_ ) + " timers running." );
+            return;
+        }
+        const auto limit = arg.ToUInt ( );
+        // Quotas only change on ZNC's thread, like this runs on.
+        if ( limit == 0 || limit > timer_quota_ ) {
+            PutModule ( "The limit must be between 1 and your quota of " + to_string ( timer_quota_ ) + "." );
+            return;
+        }
+        {
+            auto lock = lock_timers ( );
+            timer_limit_ = limit;
+        }
+        SetNV ( "limit", CString ( limit ) );
+        PutModule ( "Timer limit set to " + to_string ( limit ) + "." );
+    }
+    // Quotas are changed on the user's own module, found through the
+    // registry; timers above a lowered quota keep running, only new ones
+    // are refused.
+    void set_quota ( const CString &sLine )
+    {
+        const auto user = sLine.Token ( 1 );
+        const auto arg = sLine.Token ( 2 );
+        if ( user.empty ( ) ) {
+            PutModule ( "Your quota is " + to_string ( timer_quota_ ) + " timers." );
+            return;
+        }
+        if ( !GetUser ( )->IsAdmin ( ) ) {
+            PutModule ( "Only admins can see or change other users' quotas." );
+            return;
+        }
+        const auto quota = arg.ToUInt ( );
+        if ( !arg.empty ( ) && ( quota == 0 || quota > ALARM_MAX_LIMIT ) ) {
+            PutModule ( "The quota must be between 1 and " + to_string ( ALARM_MAX_LIMIT ) + "." );
+            return;
+        }
+        string reply;
+        const auto found = ModuleRegistry::instance ( ).with_user ( user, [ & ] ( CAlarm &module ) {
+            reply = arg.empty ( ) ? module.describe_quota ( ) : module.change_quota ( quota );
+        } );
+        PutModule ( found ? reply : user + " doesn't have the alarm module loaded." );
+    }
+    void export_command ( const CString &sLine )
+    {
+        ExportFormat format;
+        if ( !parse_export_format ( sLine.Token ( 1 ), format ) ) {
+            PutModule ( "Use export json or export csv." );
+            return;
+        }
+        const auto snapshot = list_snapshot ( );
+        const auto path = GetSavePath ( ) + "/timers." + sLine.Token ( 1 );
+        ofstream out ( path, ios::trunc | ios::binary );
+        export_timers ( *snapshot, Clock::now ( ), time ( 0 ), format, [ &out ] ( const char *data, size_t length ) {
+            out.write ( data, static_cast<streamsize> ( length ) );
+        } );
+        out.close ( );
+        PutModule ( out ? "Wrote " + to_string ( snapshot->size ( ) ) + " timers to " + path + "."
+                        : "Could not write " + path + "." );
+    }
+    void trace_command ( const CString &sLine )
+    {
+        if ( !TraceRing::compiled_in ) {
+            PutModule ( "Tracing is not compiled in, build the module with -DALARM_TRACE." );
+            return;
+        }
+        const auto arg = sLine.Token ( 1 );
+        if ( arg == "on" || arg == "off" ) {
+            trace_.enable ( arg == "on" );
+            PutModule ( arg == "on" ? "Tracing is on." : "Tracing is off." );
+        } else if ( arg == "dump" ) {
+            const auto path = GetSavePath ( ) + "/trace.log";
+            ofstream out ( path, ios::trunc );
+            out << "# begin_us kind duration_us arg\n";
+            const auto events = trace_.dump ( [ &out ] ( const char *line ) {
+                out << line << '\n';
+            } );
+            out.close ( );
+            PutModule ( out ? "Wrote " + to_string ( events ) + " events to " + path + "."
+                            : "Could not write " + path + "." );
+        } else {
+            PutModule ( string ( "Tracing is " ) + ( trace_.enabled ( ) ? "on" : "off" ) + ", use trace on, off or dump." );
+        }
+    }
+    void set_coalesce ( const CString &sLine )
+    {
+        if ( sLine.Token ( 1 ).empty ( ) ) {
+            const auto window = chrono::duration_cast<chrono::milliseconds> ( coalesce_window_ ).count ( );
+            PutModule ( window == 0 ? "Expiries are announced right away."
+                                    : "Expiries are collected for " + to_string ( window ) + "ms before being announced." );
+            return;
+        }
+        const auto duration = parse_duration ( sLine );
+        if ( duration.error != parser::ParseError::none || duration.milliseconds > COALESCE_MAX_MS ) {
+            PutModule ( "Give a window of at most " + to_string ( COALESCE_MAX_MS ) + "ms, e.g. coalesce 250ms, or 0ms to turn it off." );
+            return;
+        }
+        {
+            auto lock = lock_timers ( );
+            coalesce_window_ = chrono::milliseconds ( duration.milliseconds );
+        }
+        SetNV ( "coalesce", CString ( duration.milliseconds ) );
+        PutModule ( duration.milliseconds == 0 ? "Expiries are announced right away."
+                                               : "Coalescing window set to " + to_string ( duration.milliseconds ) + "ms." );
+    }
+    // Formats one page from a shared copy of the queue, so the lock is
+    // only held to pick up (or, after a change, rebuild) that copy.
     void list_timers ( const CString &sLine )
     {
-        lock_guard<mutex> lock ( mutex_ );
-        if ( timer_list_.empty ( ) ) PutModule ( "There are no timers running at the moment.\n" );
-        for ( auto &t : timer_list_ ) {
-            PutModule ( "Timer: " + t.get_timer ( ) +
-                        ". Timer id: " + to_string( t.get_id ( )) );
-            PutModule ( "Expires in: " + t.get_remaining_time ( ) );
-        }
-    }
-    void loop_func ()
-    {
-        while ( check_loop_ ) {
-            this_thread::sleep_for(chrono::seconds(1));
-            unique_lock<mutex> lock(mutex_);
-            if ( !timer_list_.empty() ) {
-                if ( timer_list_.front().timer_ran_out (  ) ) {
-                    PutModule ( "Timer expired: " + timer_list_.front().get_timer ( ) );
-                    timer_list_.pop_front();
+        const auto offset = static_cast<size_t> ( sLine.Token ( 1 ).ToUInt ( ) );
+        auto count = static_cast<size_t> ( sLine.Token ( 2 ).ToUInt ( ) );
+        if ( count == 0 ) count = LIST_PAGE_DEFAULT;
+        if ( count > LIST_PAGE_MAX ) count = LIST_PAGE_MAX;
+        ALARM_TRACE_SCOPE ( trace_, list, count );
+
+        const auto snapshot = list_snapshot ( );
+        if ( snapshot->empty ( ) ) {
+            PutModule ( "There are no timers running at the moment.\n" );
+            return;
+        }
+        if ( offset >= snapshot->size ( ) ) {
+            PutModule ( "There are only " + to_string ( snapshot->size ( ) ) + " timers running." );
+            return;
+        }
+        const auto end = min ( offset + count, snapshot->size ( ) );
+        const auto now = Clock::now ( );
+        prepare_expiry_texts ( now, snapshot->size ( ) );
+        const auto zone = time_zone ( );
+        CString line;
+        line.reserve ( Timer::REASON_LENGTH_MAX + 80 );
+        for ( auto i = offset; i < end; ++i ) {
+            const auto &timer = ( *snapshot )[ i ];
+            format_timer_line ( timer, now, line, &expiry_text ( timer, zone ) );
+            PutModule ( line );
+        }
+        if ( end < snapshot->size ( ) || offset > 0 )
+            PutModule ( "Showing " + to_string ( offset + 1 ) + "-" + to_string ( end ) + " of " +
+                        to_string ( snapshot->size ( ) ) +
+                        ( end < snapshot->size ( ) ? ", use list " + to_string ( end ) + " for more." : "." ) );
+    }
+    // Applies every queued request under one lock. The replies wait in
+    // replies_ for put_replies, as PutModule may only be called from ZNC's
+    // thread.
+    void drain_requests ( ) override
+    {
+        drain_requests ( true );
+    }
+    void drain_requests ( bool reply )
+    {
+        auto lock = lock_timers ( );
+        drain_pending_.store ( false );
+        const auto old_front = next_deadline ( );
+        auto applied = false;
+        while ( requests_.consume ( [ & ] ( TimerRequest &request ) {
+            auto line = apply ( request );
+            if ( reply ) replies_.push_back ( move ( line ) );
+            applied = true;
+        } ) ) { }
+        if ( !applied ) return;
+        journal_commit ( );
+        if ( next_deadline ( ) != old_front ) reschedule ( );
+    }
+    // Runs on ZNC's thread and sends the replies drain_requests queued.
+    // Returns false once no request is left waiting to be answered.
+    auto put_replies ( ) -> bool
+    {
+        vector<string> replies;
+        bool waiting, targeted;
+        {
+            auto lock = lock_timers ( );
+            replies.swap ( replies_ );
+            waiting = drain_pending_.load ( );
+            targeted = !targeted_.empty ( );
+        }
+        for ( const auto &line : replies ) PutModule ( line );
+        // The requests may have added or moved cron or targeted timers.
+        if ( threaded_ && !detached_ ) {
+            check_cron ( );
+            if ( targeted ) start_dispatcher ( );
+        }
+        return waiting;
+    }
+    // With the thread backend, the service only ever sees absolute
+    // deadlines: a cron timer that fired there waits at a stand-in
+    // deadline until this works out its next fire on ZNC's thread, where
+    // libc's time zone code is safe to call (ZNC swaps TZ there as well,
+    // without our lock). Then scheduler_ is armed for the earliest cron
+    // timer, to come back once the service has fired it.
+    void check_cron ( )
+    {
+        const auto earliest = refresh_cron ( );
+        if ( earliest == NO_DEADLINE ) {
+            if ( scheduler_ ) start_scheduler ( NO_DEADLINE );
+            return;
+        }
+        // Comes back a moment after the deadline, by when the service has
+        // fired it, or a moment from now if it is due but not fired yet.
+        start_scheduler ( max ( earliest, Clock::now ( ) ) + chrono::milliseconds ( 10 ) );
+    }
+    // Called from the TimerService thread or from expiry_timer_ once our
+    // earliest deadline (or the end of the coalescing window) passed.
+    // Up to ALARM_EXPIRY_BATCH due timers are popped in one go and held
+    // back until the window is over, then swapped into flushing_ and
+    // announced after the lock has been released; any more that are due
+    // get the next turn. The two lists trade places, so both keep their
+    // capacity.
+    void expire_timers ( ) override
+    {
+        expire_timers ( ALARM_EXPIRY_BATCH );
+    }
+    // OnLoad passes no limit, so the whole backlog goes out as one batch.
+    void expire_timers ( size_t limit )
+    {
+        ALARM_TRACE_SCOPE ( trace_, expire, 0u );
+        // OnLoad runs one expiry on ZNC's thread while the service may
+        // already be running another, and both would use flushing_.
+        unique_lock<mutex> flushing;
+        if ( threaded_ ) flushing = unique_lock<mutex> ( flush_mutex_ );
+        auto worst = Clock::duration::zero ( );
+        {
+            auto lock = lock_timers ( );
+            const auto now = Clock::now ( );
+            due_.clear ( );
+            const auto fired = timers_->pop_due ( now, limit, due_ );
+            for ( const auto &timer : due_ ) {
+                const auto late = now - timer.get_deadline ( );
+                lateness_.record ( late );
+                if ( timer.has_target ( ) ) {
+                    deliveries_.push_back ( timer );
+                } else {
+                    held_expired_.append ( timer.get_reason ( ), timer.get_reason_length ( ) );
+                    held_worst_ = max ( held_worst_, late );
+                }
+                // Recurring timers stay queued at their next deadline.
+                const auto *again = timer.is_recurring ( ) ? timers_->find ( timer.get_id ( ) ) : nullptr;
+                if ( again && timer.get_cron ( ).valid ( ) && threaded_ ) cron_fired_.push_back ( timer.get_id ( ) );
+                if ( again ) {
+                    journal_.moved ( timer.get_id ( ), wall_time_ms ( ) + milliseconds_until ( again->get_deadline ( ), now ) );
+                } else {
+                    journal_.expired ( timer.get_id ( ) );
+                    if ( timer.has_target ( ) ) targeted_.erase ( timer.get_id ( ) );
                 }
             }
+            if ( fired > 0 ) {
+                AlarmStats::bump ( stats_.expiries, fired );
+                journal_commit ( );
+            }
+            if ( !held_expired_.empty ( ) && flush_at_ == NO_DEADLINE ) flush_at_ = now + coalesce_window_;
+            if ( !held_expired_.empty ( ) && flush_at_ <= now ) {
+                flushing_.swap ( held_expired_ );
+                flush_at_ = NO_DEADLINE;
+                worst = held_worst_;
+                held_worst_ = Clock::duration::zero ( );
+            }
+            reschedule ( );
+        }
+        // The thread backend's dispatcher is already armed for them.
+        if ( !threaded_ && !deliveries_.empty ( ) ) start_dispatcher ( );
+        if ( !flushing_.empty ( ) ) {
+            DEBUG ( "alarm: " << flushing_.size ( ) << " timer(s) expired, worst lateness "
+                    << chrono::duration_cast<chrono::microseconds> ( worst ).count ( ) / 1000.0 << "ms" );
+            const auto lines = put_expired ( flushing_ );
+            AlarmStats::bump ( stats_.lines_saved, flushing_.size ( ) - lines );
+            flushing_.clear ( );
         }
     }
+    // The module's own setting, else the ZNC user's; empty is the server's.
+    auto time_zone ( ) const -> string
+    {
+        const auto zone = GetNV ( "timezone" );
+        return zone.empty ( ) ? string ( GetUser ( )->GetTimezone ( ) ) : string ( zone );
+    }
+    auto user_name ( ) const -> const string&
+    {
+        return user_name_;
+    }
+    auto next_deadline ( ) const -> Clock::time_point
+    {
+        return timers_->next_deadline ( );
+    }
+    // Runs on ZNC's thread, once a second while lines are waiting for a
+    // network's flood budget. Expiries for the same channel are merged
+    // into as few lines as fit and each network gets at most its flood
+    // burst of lines per run, so a burst of channel timers is spread out
+    // instead of flooding the server. Returns when to run again: with the
+    // thread backend a moment after the earliest targeted deadline, by
+    // when the service has fired it; the ctimer backend restarts the
+    // dispatcher from expire_timers instead. NO_DEADLINE means not before
+    // anything changes.
+    auto dispatch_deliveries ( bool everything = false ) -> Clock::time_point
+    {
+        ALARM_TRACE_SCOPE ( trace_, deliver, 0u );
+        auto earliest = NO_DEADLINE;
+        {
+            auto lock = lock_timers ( );
+            if ( threaded_ ) {
+                for ( const auto id : targeted_ ) {
+                    const auto timer = timers_->find ( id );
+                    if ( timer ) earliest = min ( earliest, timer->get_deadline ( ) );
+                }
+            }
+            for ( const auto &timer : deliveries_ ) {
+                auto &channels = outbox_entry ( outbox_, NameRef { timer.get_network_data ( ), timer.get_network_length ( ) } );
+                outbox_entry ( channels, NameRef { timer.get_channel_data ( ), timer.get_channel_length ( ) } )
+                    .append ( timer.get_reason ( ), timer.get_reason_length ( ) );
+            }
+            deliveries_.clear ( );
+        }
+        CString line;
+        line.reserve ( EXPIRED_LINE_MAX + Timer::REASON_LENGTH_MAX + Timer::CHANNEL_LENGTH_MAX + 32 );
+        for ( auto it = outbox_.begin ( ); it != outbox_.end ( ); ) {
+            auto &channels = it->second;
+            auto *network = GetUser ( )->FindNetwork ( it->first );
+            if ( !network || !network->IsIRCConnected ( ) ) {
+                for ( const auto &channel : channels )
+                    for ( size_t i = 0; i < channel.second.size ( ); ++i )
+                        PutModule ( "Timer expired (not connected to " + it->first + "): " +
+                                    string ( channel.second.data ( i ), channel.second.length ( i ) ) );
+                it = outbox_.erase ( it );
+                continue;
+            }
+            auto budget = max<size_t> ( 1u, network->GetFloodBurst ( ) );
+            while ( !channels.empty ( ) && ( everything || budget-- > 0 ) ) {
+                auto &reasons = channels.begin ( )->second;
+                line.assign ( "PRIVMSG " ).append ( channels.begin ( )->first ).append ( " :Timer expired: " );
+                size_t merged = 0u;
+                while ( merged < reasons.size ( ) &&
+                        ( merged == 0 || line.size ( ) + reasons.length ( merged ) + 3 <= EXPIRED_LINE_MAX ) ) {
+                    if ( merged > 0 ) line.append ( " | " );
+                    line.append ( reasons.data ( merged ), reasons.length ( merged ) );
+                    ++merged;
+                }
+                network->PutIRC ( line );
+                AlarmStats::bump ( stats_.lines_saved, merged - 1 );
+                reasons.drop_front ( merged );
+                if ( reasons.empty ( ) ) channels.erase ( channels.begin ( ) );
+            }
+            if ( channels.empty ( ) )
+                it = outbox_.erase ( it );
+            else
+                ++it;
+        }
+        const auto now = Clock::now ( );
+        if ( !outbox_.empty ( ) ) return now + chrono::seconds ( 1 );
+        // Due but not fired yet if it is already past; looks again shortly.
+        return earliest == NO_DEADLINE ? NO_DEADLINE : max ( earliest, now ) + chrono::milliseconds ( 10 );
+    }
 
 private:
-    const unsigned int timer_limit_ = 16u;
+    // The ctimer backend runs entirely on ZNC's own thread, so it needs no
+    // locking; the returned lock is only engaged for the thread backend.
+    auto lock_timers ( ) -> TimedLock
+    {
+        return threaded_ ? TimedLock ( mutex_, stats_, trace_ ) : TimedLock ( );
+    }
+    // Wall-clock end times are derived from one offset between the clocks,
+    // which only moves when the wall clock was changed, so they don't
+    // flicker between lists and the cached texts stay valid. Also drops
+    // the cache once it holds far more than the timers running.
+    void prepare_expiry_texts ( Clock::time_point now, size_t timers )
+    {
+        const auto offset_now = chrono::system_clock::now ( ).time_since_epoch ( ) -
+                                chrono::duration_cast<chrono::system_clock::duration> ( now.time_since_epoch ( ) );
+        if ( offset_now - wall_offset_ > chrono::seconds ( 1 ) || wall_offset_ - offset_now > chrono::seconds ( 1 ) )
+            wall_offset_ = offset_now;
+        if ( expiry_texts_.size ( ) > 2 * timers + LIST_PAGE_MAX ) expiry_texts_.clear ( );
+    }
+    // When timer expires in zone, as list and the web page show it;
+    // formatted again only once that changes.
+    auto expiry_text ( const Timer &timer, const string &zone ) -> const string&
+    {
+        const auto end_time = chrono::duration_cast<chrono::seconds> (
+            chrono::duration_cast<chrono::system_clock::duration> ( timer.get_deadline ( ).time_since_epoch ( ) ) +
+            wall_offset_ ).count ( );
+        return expiry_texts_.get ( timer.get_id ( ), end_time, [ &zone ] ( long long shown ) {
+            return local_time::format ( static_cast<time_t> ( shown ), zone, "%Y-%m-%d %H:%M:%S" );
+        } );
+    }
+    // A network or channel name straight from a Timer, so the outbox is
+    // searched without building a string; one is only made for a name the
+    // outbox doesn't have yet.
+    struct NameRef
+    {
+        const char *data;
+        size_t length;
+
+        friend auto operator< ( const string &key, NameRef name ) -> bool
+        {
+            return key.compare ( 0, string::npos, name.data, name.length ) < 0;
+        }
+        friend auto operator< ( NameRef name, const string &key ) -> bool
+        {
+            return key.compare ( 0, string::npos, name.data, name.length ) > 0;
+        }
+    };
+    template <typename Map>
+    static auto outbox_entry ( Map &outbox, NameRef name ) -> typename Map::mapped_type&
+    {
+        auto it = outbox.lower_bound ( name );
+        if ( it == outbox.end ( ) || name < it->first )
+            it = outbox.emplace_hint ( it, string ( name.data, name.length ), typename Map::mapped_type ( ) );
+        return it->second;
+    }
+    auto parse_duration ( const char *text, size_t length ) -> parser::Duration
+    {
+        ALARM_TRACE_SCOPE ( trace_, parse, length );
+        const auto begin = Clock::now ( );
+        const auto duration = parser::parse_duration ( text, length );
+        stats_.parse.record ( Clock::now ( ) - begin );
+        return duration;
+    }
+    auto parse_duration ( const string &text ) -> parser::Duration
+    {
+        return parse_duration ( text.data ( ), text.size ( ) );
+    }
+    // Must be called with the timers locked.
+    void reschedule ( )
+    {
+        if ( detached_ ) return;
+        const auto deadline = min ( next_deadline ( ), flush_at_ );
+        if ( threaded_ )
+            TimerService::instance ( ).schedule ( this, deadline );
+        else
+            arm_expiry_timer ( deadline );
+    }
+    void arm_expiry_timer ( Clock::time_point deadline );
+    void start_dispatcher ( );
+    void start_replier ( );
+    void start_scheduler ( Clock::time_point deadline );
+    // Reschedules the cron timers in cron_fired_ and returns the earliest
+    // cron deadline.
+    auto refresh_cron ( ) -> Clock::time_point
+    {
+        auto lock = lock_timers ( );
+        if ( !cron_fired_.empty ( ) ) {
+            const auto now = Clock::now ( );
+            const auto wall_now = wall_time ( );
+            const auto old_front = next_deadline ( );
+            for ( const auto id : cron_fired_ ) {
+                const auto timer = timers_->find ( id );
+                if ( !timer ) continue;
+                const auto next = timer->get_cron ( ).next_fire ( static_cast<time_t> ( wall_now ) );
+                if ( next == 0 ) {
+                    unqueue_timer ( id );
+                    journal_.expired ( id );
+                    continue;
+                }
+                timers_->reschedule ( id, now + chrono::seconds ( next - wall_now ) );
+                journal_.moved ( id, next * 1000 );
+            }
+            cron_fired_.clear ( );
+            journal_commit ( );
+            if ( next_deadline ( ) != old_front ) reschedule ( );
+        }
+        auto earliest = NO_DEADLINE;
+        for ( const auto id : cron_ids_ ) {
+            const auto timer = timers_->find ( id );
+            if ( timer ) earliest = min ( earliest, timer->get_deadline ( ) );
+        }
+        return earliest;
+    }
+
+    // build ( Timer& ) makes the new timer right inside the queued request,
+    // so its reason is copied from the command line once on the way in,
+    // and from there only into the queue's slot.
+    template <typename Build>
+    void submit_add ( string reply, Build build )
+    {
+        submit ( [ & ] ( TimerRequest &request ) {
+            build ( request.timer );
+            request.reply = move ( reply );
+        } );
+    }
+    // Commands hand their changes to the scheduler instead of taking
+    // mutex_ themselves: with the thread backend the request is applied by
+    // the service thread and answered by replier_ on ZNC's thread; the
+    // ctimer backend already owns the queue and applies and answers it
+    // right away. fill ( TimerRequest& ) writes the request into the
+    // queue's node.
+    template <typename Fill>
+    void submit ( Fill fill )
+    {
+        requests_.emplace ( fill );
+        if ( !threaded_ ) {
+            drain_requests ( );
+            put_replies ( );
+            return;
+        }
+        if ( !drain_pending_.exchange ( true ) ) TimerService::instance ( ).post ( this );
+        start_replier ( );
+    }
+    // Must be called with the timers locked, like everything that changes
+    // targeted_ or cron_ids_.
+    void queue_timer ( const Timer &timer )
+    {
+        timers_->push ( timer );
+        if ( timer.has_target ( ) ) targeted_.insert ( timer.get_id ( ) );
+        if ( timer.get_cron ( ).valid ( ) ) cron_ids_.insert ( timer.get_id ( ) );
+    }
+    auto unqueue_timer ( unsigned id ) -> bool
+    {
+        const auto timer = timers_->find ( id );
+        if ( !timer ) return false;
+        if ( timer->has_target ( ) ) targeted_.erase ( id );
+        cron_ids_.erase ( id );
+        return timers_->remove ( id );
+    }
+    // Must be called with the timers locked.
+    auto apply ( TimerRequest &request ) -> string
+    {
+        ALARM_TRACE_SCOPE ( trace_, apply, request.kind );
+        if ( request.kind == TimerRequest::Kind::cancel ) {
+            if ( !unqueue_timer ( request.id ) ) return "Timer doesn't exist.";
+            journal_.removed ( request.id );
+            AlarmStats::bump ( stats_.removes );
+            return "Removed the timer.";
+        }
+        if ( request.kind == TimerRequest::Kind::snooze || request.kind == TimerRequest::Kind::postpone ) {
+            const auto timer = timers_->find ( request.id );
+            if ( !timer ) return "Timer doesn't exist.";
+            const auto now = Clock::now ( );
+            const auto deadline = ( request.kind == TimerRequest::Kind::snooze ? now : timer->get_deadline ( ) ) + request.delta;
+            if ( deadline - now > chrono::milliseconds ( parser::DURATION_MAX ) )
+                return parser::error_message ( parser::ParseError::out_of_range );
+            timers_->reschedule ( request.id, deadline );
+            journal_.moved ( request.id, wall_time_ms ( ) + milliseconds_until ( deadline, now ) );
+            const auto end_time = wall_time ( ) + seconds_until ( deadline, now );
+            return "Timer " + to_string ( request.id ) + " now expires in " + parser::string_from_secs ( end_time ) + ".";
+        }
+        if ( timers_->size ( ) >= timer_limit_ ) return "Too many timers running, can't create a new one.";
+        request.timer.set_id ( ++timer_id_ );
+        queue_timer ( request.timer );
+        journal_added ( request.timer );
+        AlarmStats::bump ( stats_.adds );
+        return move ( request.reply );
+    }
+
+    auto describe_quota ( ) -> string
+    {
+        auto lock = lock_timers ( );
+        return user_name_ + " has " + to_string ( timers_->size ( ) ) + " timers running, limit " +
+               to_string ( timer_limit_ ) + ", quota " + to_string ( timer_quota_ ) + ".";
+    }
+    auto change_quota ( unsigned quota ) -> string
+    {
+        {
+            auto lock = lock_timers ( );
+            timer_quota_ = quota;
+            timer_limit_ = min ( timer_limit_, quota );
+        }
+        SetNV ( "quota", CString ( quota ) );
+        return "Quota for " + user_name_ + " set to " + to_string ( quota ) + ".";
+    }
+
+    auto list_snapshot ( ) -> shared_ptr<const vector<Timer>>
+    {
+        auto lock = lock_timers ( );
+        if ( !list_snapshot_ || list_version_ != timers_->version ( ) ) {
+            list_snapshot_ = make_shared<const vector<Timer>> ( timers_->sorted ( ) );
+            list_version_ = timers_->version ( );
+        }
+        return list_snapshot_;
+    }
+
+    // Replays the journal and rebuilds the queue from it in one go.
+    auto load_timers ( ) -> bool
+    {
+        vector<TimerJournal::Entry> saved;
+        const auto opened = journal_.open ( GetSavePath ( ) + "/timers.journal", saved, timer_id_ );
+        const auto now = wall_time_ms ( );
+        vector<Timer> restored;
+        restored.reserve ( saved.size ( ) );
+        // Re-anchor the saved wall-clock end times onto the monotonic clock.
+        for ( const auto &entry : saved ) {
+            restored.emplace_back ( entry.reason, chrono::milliseconds ( entry.end_ms - now ), entry.id,
+                                    chrono::milliseconds ( entry.interval_ms ) );
+            CronSchedule cron;
+            size_t consumed = 0u;
+            if ( !entry.cron.empty ( ) && cron.parse ( entry.cron, consumed ) ) {
+                restored.back ( ).set_cron ( cron );
+                restored.back ( ).set_cron_deferred ( threaded_ );
+                cron_ids_.insert ( entry.id );
+            }
+            if ( !entry.network.empty ( ) && restored.back ( ).set_target ( entry.network, entry.channel ) )
+                targeted_.insert ( entry.id );
+        }
+        timers_->assign ( restored );
+        if ( threaded_ && !cron_ids_.empty ( ) ) start_scheduler ( Clock::now ( ) );
+        if ( !targeted_.empty ( ) ) start_dispatcher ( );
+        stats_.set_timers ( timers_->size ( ) );
+        if ( opened ) compact_journal ( );
+        return opened;
+    }
+    static auto interval_ms ( const Timer &timer ) -> long long
+    {
+        return chrono::duration_cast<chrono::milliseconds> ( timer.get_interval ( ) ).count ( );
+    }
+    static auto cron_text ( const Timer &timer ) -> string
+    {
+        return timer.get_cron ( ).valid ( ) ? timer.get_cron ( ).to_string ( ) : string ( );
+    }
+    void journal_added ( const Timer &timer )
+    {
+        journal_.added ( timer.get_id ( ), timer.get_end_time_ms ( ), interval_ms ( timer ), cron_text ( timer ),
+                         timer.get_reason ( ), timer.get_reason_length ( ), timer.get_network ( ),
+                         timer.get_channel ( ) );
+    }
+    // Ends a batch of changes; must be called with the timers locked.
+    void journal_commit ( )
+    {
+        stats_.set_timers ( timers_->size ( ) );
+        journal_.flush ( );
+        if ( journal_.needs_compaction ( timers_->size ( ) ) ) compact_journal ( );
+    }
+    void compact_journal ( )
+    {
+        journal_.compact ( timer_id_, [ this ] ( auto emit ) {
+            timers_->for_each ( [ &emit ] ( const Timer &t ) {
+                emit ( t.get_id ( ), t.get_end_time_ms ( ), interval_ms ( t ), cron_text ( t ),
+                       t.get_reason ( ), t.get_reason_length ( ), t.get_network ( ), t.get_channel ( ) );
+            } );
+        } );
+    }
+    // One line for a single expiry, otherwise as few lines as fit the
+    // usual IRC line length. Every line is built in the same reserved
+    // buffer straight from the packed reasons. Returns how many lines were
+    // sent.
+    auto put_expired ( const ReasonList &expired ) -> size_t
+    {
+        ALARM_TRACE_SCOPE ( trace_, put, expired.size ( ) );
+        CString line;
+        line.reserve ( EXPIRED_LINE_MAX + Timer::REASON_LENGTH_MAX );
+        if ( expired.size ( ) == 1 ) {
+            line.assign ( "Timer expired: " ).append ( expired.data ( 0 ), expired.length ( 0 ) );
+            PutModule ( line );
+            return 1u;
+        }
+        char prefix[ 32 ];
+        const auto prefix_length = static_cast<size_t> ( snprintf ( prefix, sizeof prefix, "%zu timers expired: ", expired.size ( ) ) );
+        size_t lines = 1u;
+        line.assign ( prefix, prefix_length );
+        for ( size_t i = 0; i < expired.size ( ); ++i ) {
+            if ( line.size ( ) > prefix_length && line.size ( ) + expired.length ( i ) > EXPIRED_LINE_MAX ) {
+                PutModule ( line );
+                line.assign ( prefix, prefix_length );
+                ++lines;
+            }
+            if ( line.size ( ) > prefix_length ) line.append ( " | " );
+            line.append ( expired.data ( i ), expired.length ( i ) );
+        }
+        PutModule ( line );
+        return lines;
+    }
+
+    // Longest expiry line that gets another reason appended to it.
+    static constexpr size_t EXPIRED_LINE_MAX = 400u;
+    // Longest coalescing window the coalesce command accepts, in ms.
+    static constexpr long long COALESCE_MAX_MS = 10000;
+    // Keeps a single list from flooding the client's send queue.
+    static constexpr size_t LIST_PAGE_DEFAULT = 20u;
+    static constexpr size_t LIST_PAGE_MAX = 50u;
+
+    unsigned int timer_limit_ = ALARM_DEFAULT_LIMIT;
+    unsigned int timer_quota_ = ALARM_MAX_LIMIT;
     unsigned int timer_id_ = 0u;
-    std::list<Timer> timer_list_;
+    unique_ptr<TimerEngine> timers_ = make_timer_engine ( ALARM_DEFAULT_ENGINE );
+    string engine_ = ALARM_DEFAULT_ENGINE;
     mutex mutex_{};
-    bool check_loop_{true};
-    thread t1_;
+    // Only set once OnLoad has validated the arguments, and attached_ once
+    // the TimerService counts us.
+    bool threaded_ = false;
+    bool attached_ = false;
+    bool detached_ = false;
+    CExpiryTimer *expiry_timer_ = nullptr;
+    CDeliveryTimer *dispatcher_ = nullptr;
+    CReplyTimer *replier_ = nullptr;
+    CScheduleTimer *scheduler_ = nullptr;
+    LatencyHistogram lateness_;
+    TimerJournal journal_;
+    MpscQueue<TimerRequest> requests_;
+    atomic<bool> drain_pending_ { false };
+    // Answers to applied requests, sent by put_replies.
+    vector<string> replies_;
+    shared_ptr<const vector<Timer>> list_snapshot_;
+    unsigned long long list_version_ = 0u;
+    AlarmStats stats_;
+    TraceRing trace_;
+    // Expiries held back until flush_at_, the end of the coalescing window.
+    ReasonList held_expired_;
+    // How late the most overdue held expiry fired, for the debug log.
+    Clock::duration held_worst_ = Clock::duration::zero ( );
+    // The batch being announced, outside the lock, under flush_mutex_.
+    ReasonList flushing_;
+    mutex flush_mutex_{};
+    Clock::time_point flush_at_ = NO_DEADLINE;
+    // Targeted expiries: handed over under the lock, then queued per
+    // network and channel by the dispatcher, the only one touching outbox_.
+    vector<Timer> deliveries_;
+    // The ids of queued timers with a target, for the thread backend's
+    // dispatcher to be armed at the earliest of them.
+    set<unsigned> targeted_;
+    // The ids of the cron timers, and of those the service fired since
+    // refresh_cron last ran.
+    set<unsigned> cron_ids_;
+    vector<unsigned> cron_fired_;
+    // What the last expire_timers popped, kept to reuse its capacity.
+    vector<Timer> due_;
+    map<string, map<string, ReasonList, less<>>, less<>> outbox_;
+    Clock::duration coalesce_window_ = Clock::duration::zero ( );
+    Clock::time_point loaded_at_;
+    chrono::system_clock::duration wall_offset_ { };
+    ExpiryTextCache expiry_texts_;
+    string user_name_;
+};
+
+// A ZNC timer that is never deleted by us; instead it is paused while
+// idle and re-armed to the next deadline.
+class CDeadlineTimer : public CTimer
+{
+public:
+    CDeadlineTimer ( CAlarm *module, const CString &label, const CString &description )
+        : CTimer ( module, 1, 0, label, description )
+    {
+        Pause ( );
+    }
+    void arm ( Clock::time_point deadline )
+    {
+        if ( deadline == NO_DEADLINE ) {
+            Pause ( );
+            return;
+        }
+        const auto delay = chrono::duration<double> ( deadline - Clock::now ( ) ).count ( );
+        StartMaxCycles ( max ( delay, 0.001 ), 0 );
+        UnPause ( );
+    }
+};
+
+// The single ZNC timer behind the ctimer backend.
+class CExpiryTimer : public CDeadlineTimer
+{
+public:
+    CExpiryTimer ( CAlarm *module )
+        : CDeadlineTimer ( module, "alarm_expiry", "Delivers expired alarm timers" ) { }
+
+protected:
+    virtual void RunJob ( ) override
+    {
+        static_cast<CAlarm*> ( GetModule ( ) )->expire_timers ( );
+    }
+};
+
+// Runs CAlarm::check_cron on ZNC's thread for the thread backend's cron
+// timers; created with the first one.
+class CScheduleTimer : public CDeadlineTimer
+{
+public:
+    CScheduleTimer ( CAlarm *module )
+        : CDeadlineTimer ( module, "alarm_cron", "Works out when alarm cron timers fire next" ) { }
+
+protected:
+    virtual void RunJob ( ) override
+    {
+        static_cast<CAlarm*> ( GetModule ( ) )->check_cron ( );
+    }
 };
+
+// Runs CAlarm::dispatch_deliveries on ZNC's thread; created the first time
+// a module has a targeted timer, re-armed to when it is needed next and
+// paused in between, so a module only wakes up to deliver.
+class CDeliveryTimer : public CDeadlineTimer
+{
+public:
+    CDeliveryTimer ( CAlarm *module )
+        : CDeadlineTimer ( module, "alarm_delivery", "Posts expired alarm timers to channels" ) { }
+
+protected:
+    virtual void RunJob ( ) override
+    {
+        arm ( static_cast<CAlarm*> ( GetModule ( ) )->dispatch_deliveries ( ) );
+    }
+};
+
+// Runs CAlarm::put_replies on ZNC's thread every REPLY_POLL_SECONDS while
+// the thread backend still has requests to answer, and is paused after.
+class CReplyTimer : public CTimer
+{
+public:
+    CReplyTimer ( CAlarm *module )
+        : CTimer ( module, 1, 0, "alarm_replies", "Answers alarm commands" )
+    {
+        StartMaxCycles ( REPLY_POLL_SECONDS, 0 );
+    }
+
+protected:
+    virtual void RunJob ( ) override
+    {
+        if ( !static_cast<CAlarm*> ( GetModule ( ) )->put_replies ( ) ) Pause ( );
+    }
+
+private:
+    // The service usually applies a request well within this.
+    static constexpr double REPLY_POLL_SECONDS = 0.01;
+};
+
+void CAlarm::start_replier ( )
+{
+    if ( replier_ ) {
+        replier_->UnPause ( );
+        return;
+    }
+    replier_ = new CReplyTimer ( this );
+    AddTimer ( replier_ );
+}
+
+void CAlarm::start_scheduler ( Clock::time_point deadline )
+{
+    if ( !scheduler_ ) {
+        scheduler_ = new CScheduleTimer ( this );
+        AddTimer ( scheduler_ );
+    }
+    scheduler_->arm ( deadline );
+}
+
+// Runs the dispatcher as soon as possible, which then arms itself.
+void CAlarm::start_dispatcher ( )
+{
+    if ( !dispatcher_ ) {
+        dispatcher_ = new CDeliveryTimer ( this );
+        AddTimer ( dispatcher_ );
+    }
+    dispatcher_->arm ( Clock::now ( ) );
+}
+
+template <typename Visit>
+auto ModuleRegistry::with_user ( const string &user, Visit visit ) -> bool
+{
+    lock_guard<mutex> lock ( mutex_ );
+    for ( auto *module : modules_ ) {
+        if ( module->user_name ( ) != user ) continue;
+        visit ( *module );
+        return true;
+    }
+    return false;
+}
+
+void CAlarm::arm_expiry_timer ( Clock::time_point deadline )
+{
+    if ( !expiry_timer_ ) {
+        if ( deadline == NO_DEADLINE ) return;
+        expiry_timer_ = new CExpiryTimer ( this );
+        AddTimer ( expiry_timer_ );
+    }
+    expiry_timer_->arm ( deadline );
+}
+
 USERMODULEDEFS( CAlarm, "A simple alarm clock" )
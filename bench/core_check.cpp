@@ -0,0 +1,312 @@
+/*
+* Checks the ZNC independent parts of the module whose mistakes would only
+* show up days later: cron's next fire times, the journal's replay and
+* compaction, and TimerIndex's erase. Exits with 1 on any mismatch.
+* Build and run from the repository root:
+*   g++ -std=c++14 -O2 -I. bench/core_check.cpp -o core_check && ./core_check
+*
+* The cron checks run in Europe/Berlin, so the zone database has to be
+* installed.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include "cron.h"
+#include "journal.h"
+#include "timer_core.h"
+
+using namespace std;
+
+namespace
+{
+unsigned checks = 0u, failures = 0u;
+
+void check ( bool ok, const string &what )
+{
+    ++checks;
+    if ( ok ) return;
+    ++failures;
+    printf ( "FAIL: %s\n", what.c_str ( ) );
+}
+
+// A local time in the process's zone, which main sets to Europe/Berlin.
+auto at ( int year, int month, int day, int hour, int minute ) -> time_t
+{
+    tm t { };
+    t.tm_year = year - 1900;
+    t.tm_mon = month - 1;
+    t.tm_mday = day;
+    t.tm_hour = hour;
+    t.tm_min = minute;
+    t.tm_isdst = -1;
+    return mktime ( &t );
+}
+
+auto shown ( time_t when ) -> string
+{
+    if ( when == 0 ) return "never";
+    char text[ 64 ];
+    tm t;
+    localtime_r ( &when, &t );
+    return string ( text, strftime ( text, sizeof text, "%Y-%m-%d %H:%M %Z", &t ) );
+}
+
+// The fires of expression after from, in order, until count or never.
+auto fires ( const string &expression, time_t from, size_t count ) -> vector<time_t>
+{
+    CronSchedule cron;
+    size_t consumed = 0u;
+    check ( cron.parse ( expression, consumed ) && consumed == expression.size ( ), "parse " + expression );
+    vector<time_t> result;
+    for ( auto when = from; result.size ( ) < count; ) {
+        when = cron.next_fire ( when );
+        result.push_back ( when );
+        if ( when == 0 ) break;
+    }
+    return result;
+}
+
+void expect_fires ( const string &expression, time_t from, const vector<time_t> &expected )
+{
+    const auto got = fires ( expression, from, expected.size ( ) );
+    for ( size_t i = 0; i < expected.size ( ); ++i ) {
+        const auto actual = i < got.size ( ) ? got[ i ] : 0;
+        check ( actual == expected[ i ], expression + " after " + shown ( from ) + ", fire " + to_string ( i + 1 ) +
+                ": expected " + shown ( expected[ i ] ) + ", got " + shown ( actual ) );
+    }
+}
+
+void check_cron ( )
+{
+    // With both day fields restricted either one matches, otherwise the
+    // restricted one has to. 2026-12-11 is a Friday, the 13th a Sunday.
+    expect_fires ( "0 12 13 * 5", at ( 2026, 12, 5, 0, 0 ), { at ( 2026, 12, 11, 12, 0 ), at ( 2026, 12, 13, 12, 0 ),
+                                                              at ( 2026, 12, 18, 12, 0 ) } );
+    expect_fires ( "0 12 13 * *", at ( 2026, 12, 5, 0, 0 ), { at ( 2026, 12, 13, 12, 0 ), at ( 2027, 1, 13, 12, 0 ) } );
+    expect_fires ( "0 12 * * 5", at ( 2026, 12, 5, 0, 0 ), { at ( 2026, 12, 11, 12, 0 ), at ( 2026, 12, 18, 12, 0 ) } );
+    // A day that doesn't exist never comes.
+    expect_fires ( "0 0 30 2 *", at ( 2026, 1, 1, 0, 0 ), { 0 } );
+    expect_fires ( "0 0 31 4,6,9,11 *", at ( 2026, 1, 1, 0, 0 ), { 0 } );
+    // Leap days only, and with a weekday any Monday in February as well.
+    expect_fires ( "0 0 29 2 *", at ( 2026, 3, 1, 0, 0 ), { at ( 2028, 2, 29, 0, 0 ), at ( 2032, 2, 29, 0, 0 ) } );
+    expect_fires ( "0 0 29 2 mon", at ( 2026, 3, 1, 0, 0 ), { at ( 2027, 2, 1, 0, 0 ), at ( 2027, 2, 8, 0, 0 ) } );
+    // 7 is Sunday just like 0. 2026-10-18 is a Sunday.
+    expect_fires ( "0 9 * * 7", at ( 2026, 10, 14, 0, 0 ), { at ( 2026, 10, 18, 9, 0 ), at ( 2026, 10, 25, 9, 0 ) } );
+    expect_fires ( "0 9 * * 5-7", at ( 2026, 10, 14, 0, 0 ), { at ( 2026, 10, 16, 9, 0 ), at ( 2026, 10, 17, 9, 0 ),
+                                                               at ( 2026, 10, 18, 9, 0 ), at ( 2026, 10, 23, 9, 0 ) } );
+    CronSchedule sunday;
+    size_t consumed = 0u;
+    check ( sunday.parse ( "0 9 * * 7", consumed ) && sunday.to_string ( ) == "0 9 * * 0", "7 is written as 0" );
+    check ( sunday.parse ( "0 9 * * 0-7", consumed ) && sunday.to_string ( ) == "0 9 * * *", "0-7 is every day" );
+    // Daylight saving: on 2027-03-28 02:00 becomes 03:00, so that day has
+    // no 02:30 and the schedule skips it; on 2026-10-25 03:00 goes back to
+    // 02:00 and a time in the repeated hour fires only once.
+    expect_fires ( "30 2 * * *", at ( 2027, 3, 27, 3, 0 ), { at ( 2027, 3, 29, 2, 30 ) } );
+    expect_fires ( "0 * * * *", at ( 2027, 3, 28, 0, 30 ), { at ( 2027, 3, 28, 1, 0 ), at ( 2027, 3, 28, 3, 0 ) } );
+    const auto repeated = fires ( "30 2 * * *", at ( 2026, 10, 24, 3, 0 ), 2 );
+    check ( repeated.size ( ) == 2 && repeated[ 1 ] - repeated[ 0 ] == 25 * 3600,
+            "30 2 * * * fires once on 2026-10-25, then a day later" );
+    const auto hourly = fires ( "0 * * * *", at ( 2026, 10, 25, 0, 30 ), 4 );
+    for ( size_t i = 1; i < hourly.size ( ); ++i )
+        check ( hourly[ i ] > hourly[ i - 1 ] && hourly[ i ] - hourly[ i - 1 ] <= 7200,
+                "0 * * * * goes forward by at most two hours at " + shown ( hourly[ i - 1 ] ) );
+}
+
+auto read_journal ( const string &path, unsigned &last_id ) -> map<unsigned, TimerJournal::Entry>
+{
+    TimerJournal journal;
+    vector<TimerJournal::Entry> live;
+    last_id = 0u;
+    check ( journal.open ( path, live, last_id ), "open " + path );
+    map<unsigned, TimerJournal::Entry> by_id;
+    for ( auto &entry : live ) by_id[ entry.id ] = entry;
+    check ( by_id.size ( ) == live.size ( ), "each live timer is replayed once" );
+    return by_id;
+}
+
+void expect_entry ( const map<unsigned, TimerJournal::Entry> &live, unsigned id, long long end_ms, long long interval_ms,
+                    const string &cron, const string &reason, const string &network, const string &channel )
+{
+    const auto it = live.find ( id );
+    const auto what = "journal timer " + to_string ( id );
+    check ( it != live.end ( ), what + " is live" );
+    if ( it == live.end ( ) ) return;
+    const auto &entry = it->second;
+    check ( entry.end_ms == end_ms, what + " end time " + to_string ( entry.end_ms ) );
+    check ( entry.interval_ms == interval_ms, what + " interval " + to_string ( entry.interval_ms ) );
+    check ( entry.cron == cron, what + " cron '" + entry.cron + "'" );
+    check ( entry.reason == reason, what + " reason '" + entry.reason + "'" );
+    check ( entry.network == network && entry.channel == channel, what + " target '" + entry.network + " " + entry.channel + "'" );
+}
+
+void check_journal ( const string &directory )
+{
+    const auto path = directory + "/timers.journal";
+    // End times are Unix milliseconds, here in 2027.
+    const auto at = 1800000000000LL;
+    {
+        TimerJournal journal;
+        vector<TimerJournal::Entry> none;
+        unsigned last_id = 0u;
+        check ( journal.open ( path, none, last_id ) && none.empty ( ) && last_id == 0u, "a new journal is empty" );
+        const string tea = "tea", legs = "stretch legs", standup = "standup meeting", deploy = "deploy", gone = "gone";
+        journal.added ( 1u, at + 1000, 0, "", tea.data ( ), tea.size ( ), "", "" );
+        journal.added ( 2u, at + 2000, 60000, "", legs.data ( ), legs.size ( ), "", "" );
+        journal.added ( 3u, at + 3000, 0, "0,30 9 * * 1,2,3,4,5", standup.data ( ), standup.size ( ), "", "" );
+        journal.added ( 4u, at + 4000, 0, "", deploy.data ( ), deploy.size ( ), "libera", "#ops" );
+        journal.added ( 5u, at + 5000, 0, "", gone.data ( ), gone.size ( ), "libera", "#ops" );
+        journal.added ( 6u, at + 6000, 0, "", gone.data ( ), gone.size ( ), "", "" );
+        journal.moved ( 1u, at + 1500 );
+        journal.moved ( 3u, at + 3600 );
+        journal.removed ( 5u );
+        journal.expired ( 6u );
+        journal.flush ( );
+        check ( !journal.needs_compaction ( 4u ), "a short journal isn't compacted" );
+        for ( unsigned id = 100u; id < 200u; ++id ) journal.expired ( id );
+        check ( journal.needs_compaction ( 4u ), "a journal of dead records is compacted" );
+    }
+    // Records a crash or an older version could have left behind.
+    {
+        ofstream out ( path, ios::app );
+        out << "P 7 100 0 no interval\n"
+            << "C 8 100 * * *\n"
+            << "T 99 libera #nowhere\n"
+            << "M 98 5\n"
+            << "M 1\n"
+            << "A x 100 no id\n"
+            << "garbage\n"
+            << "A 9 1800000000 from before milliseconds\n";
+    }
+    unsigned last_id = 0u;
+    auto live = read_journal ( path, last_id );
+    check ( live.size ( ) == 5u, "replay keeps 5 timers, not " + to_string ( live.size ( ) ) );
+    check ( last_id == 199u, "replay raises the last id to 199, not " + to_string ( last_id ) );
+    expect_entry ( live, 1u, at + 1500, 0, "", "tea", "", "" );
+    expect_entry ( live, 2u, at + 2000, 60000, "", "stretch legs", "", "" );
+    expect_entry ( live, 3u, at + 3600, 0, "0,30 9 * * 1,2,3,4,5", "standup meeting", "", "" );
+    expect_entry ( live, 4u, at + 4000, 0, "", "deploy", "libera", "#ops" );
+    expect_entry ( live, 9u, at, 0, "", "from before milliseconds", "", "" );
+
+    // Compacting writes the live timers and the last id, nothing else.
+    {
+        TimerJournal journal;
+        vector<TimerJournal::Entry> replayed;
+        unsigned replayed_id = 0u;
+        journal.open ( path, replayed, replayed_id );
+        check ( journal.compact ( 250u, [ &replayed ] ( auto emit ) {
+                    for ( const auto &e : replayed )
+                        emit ( e.id, e.end_ms, e.interval_ms, e.cron, e.reason.data ( ), e.reason.size ( ), e.network, e.channel );
+                } ), "compact" );
+        check ( !journal.needs_compaction ( 4u ), "a compacted journal isn't compacted again" );
+        journal.moved ( 2u, at + 2500 );
+        journal.flush ( );
+    }
+    ifstream in ( path );
+    size_t lines = 0u;
+    for ( string line; getline ( in, line ); ) ++lines;
+    check ( lines == 8u, "the compacted journal has N, 5 adds, T and M, not " + to_string ( lines ) + " lines" );
+    live = read_journal ( path, last_id );
+    check ( live.size ( ) == 5u && last_id == 250u, "compaction keeps the timers and the last id" );
+    expect_entry ( live, 1u, at + 1500, 0, "", "tea", "", "" );
+    expect_entry ( live, 2u, at + 2500, 60000, "", "stretch legs", "", "" );
+    expect_entry ( live, 3u, at + 3600, 0, "0,30 9 * * 1,2,3,4,5", "standup meeting", "", "" );
+    expect_entry ( live, 4u, at + 4000, 0, "", "deploy", "libera", "#ops" );
+    expect_entry ( live, 9u, at, 0, "", "from before milliseconds", "", "" );
+    remove ( path.c_str ( ) );
+}
+
+auto home16 ( unsigned id ) -> unsigned
+{
+    return ( id * 2654435761u ) & 15u;
+}
+
+void expect_index ( const TimerIndex &index, const map<unsigned, uint32_t> &live, const vector<unsigned> &erased,
+                    const string &what )
+{
+    for ( const auto &entry : live ) {
+        const auto slot = index.find ( entry.first );
+        check ( slot && *slot == entry.second, what + ": id " + to_string ( entry.first ) + " is found" );
+    }
+    for ( const auto id : erased ) check ( !index.find ( id ), what + ": erased id " + to_string ( id ) + " is gone" );
+}
+
+void check_index ( )
+{
+    // Sixteen buckets hold up to eight ids. Three want the last bucket,
+    // two the first and one the second, so they form one run that wraps
+    // around; erasing them in every order has to keep the rest reachable.
+    vector<unsigned> ids;
+    for ( unsigned want : { 15u, 15u, 15u, 0u, 0u, 1u } )
+        for ( unsigned id = ids.empty ( ) ? 1u : ids.back ( ) + 1; ; ++id )
+            if ( home16 ( id ) == want && find ( ids.begin ( ), ids.end ( ), id ) == ids.end ( ) ) {
+                ids.push_back ( id );
+                break;
+            }
+    auto order = ids;
+    sort ( order.begin ( ), order.end ( ) );
+    do {
+        TimerIndex index;
+        map<unsigned, uint32_t> live;
+        for ( size_t i = 0; i < ids.size ( ); ++i ) {
+            index.insert ( ids[ i ], static_cast<uint32_t> ( i ) );
+            live[ ids[ i ] ] = static_cast<uint32_t> ( i );
+        }
+        vector<unsigned> erased;
+        for ( const auto id : order ) {
+            index.erase ( id );
+            live.erase ( id );
+            erased.push_back ( id );
+            expect_index ( index, live, erased, "wrapped run" );
+        }
+    } while ( failures == 0 && next_permutation ( order.begin ( ), order.end ( ) ) );
+
+    // And against unordered_map, through growth and a lot of churn.
+    mt19937 random ( 1u );
+    uniform_int_distribution<unsigned> pick ( 1u, 4096u );
+    TimerIndex index;
+    unordered_map<unsigned, uint32_t> reference;
+    for ( uint32_t step = 0u; step < 200000u && failures == 0; ++step ) {
+        const auto id = pick ( random );
+        if ( reference.count ( id ) ) {
+            index.erase ( id );
+            reference.erase ( id );
+        } else {
+            index.insert ( id, step );
+            reference[ id ] = step;
+        }
+        if ( step % 1000u != 0u ) continue;
+        for ( unsigned probe = 1u; probe <= 4096u; ++probe ) {
+            const auto slot = index.find ( probe );
+            const auto it = reference.find ( probe );
+            check ( it == reference.end ( ) ? !slot : slot && *slot == it->second,
+                    "churn step " + to_string ( step ) + ": id " + to_string ( probe ) );
+        }
+    }
+}
+} // namespace
+
+int main ( )
+{
+    setenv ( "TZ", "Europe/Berlin", 1 );
+    tzset ( );
+    char directory[] = "/tmp/core_check.XXXXXX";
+    if ( !mkdtemp ( directory ) ) {
+        perror ( "mkdtemp" );
+        return 1;
+    }
+    check_cron ( );
+    check_journal ( directory );
+    check_index ( );
+    rmdir ( directory );
+    printf ( "%u checks, %u failed\n", checks, failures );
+    return failures == 0 ? 0 : 1;
+}
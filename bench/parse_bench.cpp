@@ -0,0 +1,70 @@
+/*
+* Compares parser::parse_duration with the regex based parser it replaced.
+* Build and run from the repository root:
+*   g++ -std=c++14 -O2 -I. bench/parse_bench.cpp -o parse_bench && ./parse_bench
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <regex>
+#include <string>
+#include <vector>
+#include "parser.h"
+
+using namespace std;
+
+// The grammar is constexpr, so the basics are checked at compile time.
+static_assert ( parser::parse_duration ( "add 1h30m tea", 13 ).milliseconds == 5400000, "" );
+static_assert ( parser::parse_duration ( "add 2d 1s x", 11 ).milliseconds == 172801000, "" );
+static_assert ( parser::parse_duration ( "add 1m30s250ms x", 16 ).milliseconds == 90250, "" );
+static_assert ( parser::parse_duration ( "add tea", 7 ).error == parser::ParseError::no_duration, "" );
+static_assert ( parser::parse_duration ( "add 1m 2m", 9 ).error == parser::ParseError::duplicate_unit, "" );
+static_assert ( parser::parse_duration ( "add 99999999999999999999999s x", 30 ).error == parser::ParseError::out_of_range, "" );
+static_assert ( parser::parse_id ( "remove 42", 9 ) == 42u, "" );
+
+namespace
+{
+auto regex_secs_from_string ( const string &sLine ) -> long long {
+    smatch match;
+    auto seconds = 0LL;
+
+    if ( regex_search ( sLine, match, regex("([0-9]{1,2})s")) )
+        seconds += stoll ( match[ 1 ] );
+    if ( regex_search ( sLine, match, regex("([0-9]{1,2})m") ) )
+        seconds += ( stoll ( match[ 1 ] ) * 60 );
+    if ( regex_search ( sLine, match, regex("([0-9]{1,2})h") ) )
+        seconds += ( stoll ( match[ 1 ] ) * 3600 );
+    if ( regex_search ( sLine, match, regex("([0-9]{1,3})d") ) )
+        seconds += ( stoll ( match[ 1 ] ) * 86400 );
+
+    return seconds;
+}
+
+template <typename Parse>
+auto ns_per_call ( const vector<string> &lines, size_t rounds, Parse parse ) -> double
+{
+    long long sink = 0;
+    const auto start = chrono::steady_clock::now ( );
+    for ( size_t r = 0; r < rounds; ++r )
+        for ( const auto &line : lines ) sink += parse ( line );
+    const auto elapsed = chrono::steady_clock::now ( ) - start;
+    if ( sink == 42 ) puts ( "" );
+    return chrono::duration<double, nano> ( elapsed ).count ( ) / ( rounds * lines.size ( ) );
+}
+} // namespace
+
+int main ( )
+{
+    const vector<string> lines {
+        "add 5m tea", "add 1h 30m standup meeting", "add 2d 3h 4m 5s long one",
+        "add 45s quick", "add 10m check the oven before it burns",
+    };
+    const auto regex_ns = ns_per_call ( lines, 2000, regex_secs_from_string );
+    const auto parser_ns = ns_per_call ( lines, 200000, [ ] ( const string &line ) {
+        return parser::parse_duration ( line ).milliseconds / 1000;
+    } );
+    printf ( "regex parser:   %10.1f ns/call\n", regex_ns );
+    printf ( "single pass:    %10.1f ns/call\n", parser_ns );
+    printf ( "speedup:        %10.1fx\n", regex_ns / parser_ns );
+    return 0;
+}
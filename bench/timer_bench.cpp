@@ -0,0 +1,292 @@
+/*
+* Benchmarks the ZNC independent timer core (timer_core.h).
+* Build and run from the repository root:
+*   g++ -std=c++14 -O2 -I. bench/timer_bench.cpp -o timer_bench && ./timer_bench
+*
+* Covers parsing, insert/cancel/reschedule/pop on queues of 16 up to 1M timers,
+* the heap and wheel engines side by side, a burst of timers expiring at once,
+* replaying the journal on load, formatting list pages and exporting the
+* timers as JSON and CSV. Every line
+* is the average cost of one operation, so runs can be compared before
+* deploying a change.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "journal.h"
+#include "parser.h"
+#include "timer_core.h"
+#include "timer_export.h"
+#include "timer_service.h"
+
+using namespace std;
+
+namespace
+{
+long long sink = 0;
+
+template <typename Run>
+auto ns_per_op ( size_t ops, Run run ) -> double
+{
+    const auto start = chrono::steady_clock::now ( );
+    run ( );
+    const auto elapsed = chrono::steady_clock::now ( ) - start;
+    return chrono::duration<double, nano> ( elapsed ).count ( ) / ops;
+}
+
+void report ( const char *what, size_t size, double ns )
+{
+    printf ( "%-22s %8zu timers %10.1f ns/op\n", what, size, ns );
+}
+
+void bench_parse ( )
+{
+    const vector<string> lines {
+        "add 5m tea", "add 1h 30m standup meeting", "add 2d 3h 4m 5s long one",
+        "add 45s quick", "add 1s500ms ping", "add 10m check the oven before it burns",
+    };
+    const size_t rounds = 200000u;
+    size_t bytes = 0u;
+    for ( const auto &line : lines ) bytes += line.size ( );
+    const auto ns = ns_per_op ( rounds * lines.size ( ), [ & ] ( ) {
+        for ( size_t r = 0; r < rounds; ++r )
+            for ( const auto &line : lines ) sink += parser::parse_duration ( line ).milliseconds;
+    } );
+    printf ( "%-22s %8s        %10.1f ns/op (%.0f MB/s)\n", "parse_duration", "",
+             ns, bytes / ( ns * lines.size ( ) ) * 1000.0 );
+}
+
+// Insert size timers with random deadlines, cancel half of them by id,
+// move the other half to new deadlines and pop them. Small queues are repeated so every size does about the
+// same amount of work.
+void bench_queue ( size_t size )
+{
+    mt19937 random ( 42u );
+    uniform_int_distribution<long long> spread ( 0, 86400000 );
+    vector<chrono::milliseconds> offsets;
+    offsets.reserve ( size );
+    for ( size_t i = 0; i < size; ++i ) offsets.emplace_back ( spread ( random ) );
+    vector<unsigned> cancel;
+    for ( unsigned id = 1; id <= size; id += 2 ) cancel.push_back ( id );
+    shuffle ( cancel.begin ( ), cancel.end ( ), random );
+    vector<unsigned> moved;
+    for ( unsigned id = 2; id <= size; id += 2 ) moved.push_back ( id );
+    shuffle ( moved.begin ( ), moved.end ( ), random );
+
+    const auto rounds = max<size_t> ( 1u, 1000000u / size );
+    const auto base = Clock::now ( );
+    Timer timer ( "5m tea", chrono::minutes ( 5 ), 0u );
+    double insert_ns = 0, cancel_ns = 0, reschedule_ns = 0, pop_ns = 0;
+    for ( size_t r = 0; r < rounds; ++r ) {
+        TimerQueue timers;
+        insert_ns += ns_per_op ( size, [ & ] ( ) {
+            for ( size_t i = 0; i < size; ++i ) {
+                timer.set_id ( static_cast<unsigned> ( i + 1 ) );
+                timer.set_deadline ( base + offsets[ i ] );
+                timers.push ( timer );
+            }
+        } );
+        cancel_ns += ns_per_op ( cancel.size ( ), [ & ] ( ) {
+            for ( const auto id : cancel ) sink += timers.remove ( id );
+        } );
+        reschedule_ns += ns_per_op ( moved.size ( ), [ & ] ( ) {
+            for ( size_t i = 0; i < moved.size ( ); ++i ) sink += timers.reschedule ( moved[ i ], base + offsets[ i ] );
+        } );
+        const auto left = timers.size ( );
+        pop_ns += ns_per_op ( left, [ & ] ( ) {
+            while ( !timers.empty ( ) ) {
+                sink += timers.top ( ).get_id ( );
+                timers.pop ( );
+            }
+        } );
+    }
+    report ( "insert", size, insert_ns / rounds );
+    report ( "cancel", size, cancel_ns / rounds );
+    report ( "reschedule", size, reschedule_ns / rounds );
+    report ( "pop", size, pop_ns / rounds );
+}
+
+// The same insert, cancel and expiry through the TimerEngine interface,
+// once per engine, as CAlarm runs it: half the timers are cancelled and the
+// rest expire by pop_due while a simulated day goes by a second at a time.
+void bench_engine ( const string &name, size_t size )
+{
+    mt19937 random ( 42u );
+    uniform_int_distribution<long long> spread ( 0, 86400000 );
+    vector<chrono::milliseconds> offsets;
+    offsets.reserve ( size );
+    for ( size_t i = 0; i < size; ++i ) offsets.emplace_back ( spread ( random ) );
+    vector<unsigned> cancel;
+    for ( unsigned id = 1; id <= size; id += 2 ) cancel.push_back ( id );
+    shuffle ( cancel.begin ( ), cancel.end ( ), random );
+
+    const auto rounds = max<size_t> ( 1u, 100000u / size );
+    Timer timer ( "5m tea", chrono::minutes ( 5 ), 0u );
+    vector<Timer> due;
+    double insert_ns = 0, cancel_ns = 0, expire_ns = 0;
+    for ( size_t r = 0; r < rounds; ++r ) {
+        const auto timers = make_timer_engine ( name );
+        const auto base = Clock::now ( );
+        insert_ns += ns_per_op ( size, [ & ] ( ) {
+            for ( size_t i = 0; i < size; ++i ) {
+                timer.set_id ( static_cast<unsigned> ( i + 1 ) );
+                timer.set_deadline ( base + offsets[ i ] );
+                timers->push ( timer );
+            }
+        } );
+        cancel_ns += ns_per_op ( cancel.size ( ), [ & ] ( ) {
+            for ( const auto id : cancel ) sink += timers->remove ( id );
+        } );
+        const auto left = timers->size ( );
+        expire_ns += ns_per_op ( left, [ & ] ( ) {
+            for ( auto now = base; timers->size ( ) > 0; now += chrono::seconds ( 1 ) ) {
+                due.clear ( );
+                sink += timers->pop_due ( now, 256u, due );
+            }
+        } );
+    }
+    report ( ( name + " insert" ).c_str ( ), size, insert_ns / rounds );
+    report ( ( name + " cancel" ).c_str ( ), size, cancel_ns / rounds );
+    report ( ( name + " expire" ).c_str ( ), size, expire_ns / rounds );
+}
+
+// size timers that all ran out at once, drained the way expire_timers
+// does it: pop_due a batch at a time and append each reason to the
+// ReasonList the announcement is built from.
+void bench_burst ( size_t size )
+{
+    TimerQueue timers;
+    timers.reserve ( size );
+    Timer timer ( "burst", chrono::seconds ( 0 ), 0u );
+    const auto deadline = Clock::now ( );
+    for ( size_t i = 0; i < size; ++i ) {
+        timer.set_id ( static_cast<unsigned> ( i + 1 ) );
+        timer.set_deadline ( deadline );
+        timers.push ( timer );
+    }
+    vector<Timer> due;
+    ReasonList expired;
+    const auto ns = ns_per_op ( size, [ & ] ( ) {
+        const auto now = Clock::now ( );
+        do {
+            due.clear ( );
+            timers.pop_due ( now, ALARM_EXPIRY_BATCH, due );
+            for ( const auto &t : due ) expired.append ( t.get_reason ( ), t.get_reason_length ( ) );
+        } while ( !due.empty ( ) );
+    } );
+    sink += expired.size ( );
+    report ( "burst expiry", size, ns );
+}
+
+// Reloading size timers the way load_timers does: replay the journal,
+// re-anchor the end times onto the monotonic clock and rebuild the queue
+// in one go.
+void bench_replay ( size_t size )
+{
+    char directory[] = "/tmp/timer_bench.XXXXXX";
+    if ( !mkdtemp ( directory ) ) return;
+    const auto path = string ( directory ) + "/timers.journal";
+    {
+        TimerJournal journal;
+        vector<TimerJournal::Entry> none;
+        unsigned last_id = 0u;
+        journal.open ( path, none, last_id );
+        const string reason = "check the oven before it burns";
+        const auto now = wall_time_ms ( );
+        for ( size_t i = 0; i < size; ++i )
+            journal.added ( static_cast<unsigned> ( i + 1 ), now + 60000 + static_cast<long long> ( i ), 0, "",
+                            reason.data ( ), reason.size ( ), "", "" );
+        journal.flush ( );
+    }
+    TimerQueue timers;
+    const auto ns = ns_per_op ( size, [ & ] ( ) {
+        TimerJournal journal;
+        vector<TimerJournal::Entry> saved;
+        unsigned last_id = 0u;
+        journal.open ( path, saved, last_id );
+        const auto now = wall_time_ms ( );
+        vector<Timer> restored;
+        restored.reserve ( saved.size ( ) );
+        for ( const auto &entry : saved )
+            restored.emplace_back ( entry.reason, chrono::milliseconds ( entry.end_ms - now ), entry.id,
+                                    chrono::milliseconds ( entry.interval_ms ) );
+        timers.assign ( restored );
+    } );
+    sink += static_cast<long long> ( timers.size ( ) );
+    std::remove ( path.c_str ( ) );
+    rmdir ( directory );
+    report ( "journal replay", size, ns );
+}
+
+// Snapshot plus formatting, i.e. what a list after a change costs, and
+// formatting a single page from an existing snapshot.
+void bench_list ( size_t size )
+{
+    TimerQueue timers;
+    Timer timer ( "check the oven before it burns", chrono::minutes ( 5 ), 0u );
+    for ( size_t i = 0; i < size; ++i ) {
+        timer.set_id ( static_cast<unsigned> ( i + 1 ) );
+        timer.set_deadline ( Clock::now ( ) + chrono::seconds ( i ) );
+        timers.push ( timer );
+    }
+    string line;
+    vector<Timer> snapshot;
+    const auto snapshot_ns = ns_per_op ( size, [ & ] ( ) {
+        snapshot = timers.sorted ( );
+    } );
+    const auto page = min<size_t> ( 50u, snapshot.size ( ) );
+    const size_t rounds = 10000u;
+    const auto now = Clock::now ( );
+    const auto format_ns = ns_per_op ( rounds * page, [ & ] ( ) {
+        for ( size_t r = 0; r < rounds; ++r )
+            for ( size_t i = 0; i < page; ++i ) {
+                format_timer_line ( snapshot[ i ], now, line );
+                sink += line.size ( );
+            }
+    } );
+    report ( "list snapshot", size, snapshot_ns );
+    report ( "list format line", size, format_ns );
+}
+// Exporting a snapshot of size timers into a sink that only counts the
+// bytes, i.e. the serializer's own cost per timer.
+void bench_export ( size_t size )
+{
+    vector<Timer> snapshot;
+    snapshot.reserve ( size );
+    Timer timer ( "check the \"oven\", before it burns", chrono::minutes ( 5 ), 0u );
+    const auto now = Clock::now ( );
+    for ( size_t i = 0; i < size; ++i ) {
+        timer.set_id ( static_cast<unsigned> ( i + 1 ) );
+        timer.set_deadline ( now + chrono::seconds ( i ) );
+        snapshot.push_back ( timer );
+    }
+    for ( const auto format : { ExportFormat::json, ExportFormat::csv } ) {
+        size_t bytes = 0u;
+        const auto ns = ns_per_op ( size, [ & ] ( ) {
+            bytes = export_timers ( snapshot, now, time ( 0 ), format, [ ] ( const char *data, size_t length ) {
+                sink += data[ length - 1 ];
+            } );
+        } );
+        printf ( "%-22s %8zu timers %10.1f ns/op (%.0f MB/s)\n", format == ExportFormat::json ? "export json" : "export csv",
+                 size, ns, bytes / ( ns * size ) * 1000.0 );
+    }
+}
+} // namespace
+
+int main ( )
+{
+    bench_parse ( );
+    for ( const size_t size : { 16u, 1000u, 100000u, 1000000u } ) bench_queue ( size );
+    for ( const size_t size : { 1000u, 100000u, 1000000u } )
+        for ( const char *name : { "heap", "wheel" } ) bench_engine ( name, size );
+    for ( const size_t size : { 1000u, 100000u } ) bench_burst ( size );
+    for ( const size_t size : { 10000u, 100000u } ) bench_replay ( size );
+    for ( const size_t size : { 1000u, 100000u } ) bench_list ( size );
+    bench_export ( 100000u );
+    return sink == 42 ? 1 : 0;
+}
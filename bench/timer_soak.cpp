@@ -0,0 +1,544 @@
+/*
+* Soak test for the ZNC independent timer core (timer_core.h): one timer
+* engine per simulated user, all run by the module's own TimerService
+* (timer_service.h) under synthetic traffic.
+* Build and run from the repository root:
+*   g++ -std=c++14 -O2 -pthread -I. bench/timer_soak.cpp -o timer_soak && ./timer_soak
+*
+* Producer threads add, remove and snooze timers at a steady rate, each
+* change queued and posted to the service the way CAlarm's commands are.
+* Every second they add a burst of timers that all fall due at the same
+* instant. Some timers repeat by interval and some by a cron schedule,
+* whose deadlines come from the wall clock. Every reload_every seconds a
+* tenth of the users are reloaded like the module: detached (all
+* producers at once), their timers written to a journal, read back and
+* re-anchored from wall-clock end times, then attached again. Every
+* jump_every seconds, half a second after the burst, the wall clock the
+* core reads (wall_clock_offset) jumps an hour back or forward; this may
+* neither make timers fire in a burst nor early, also not after a reload
+* or for cron schedules worked out from the jumped clock. All random
+* choices come from the seed, so runs are repeatable up to how the
+* threads get scheduled. At the end it reports throughput, memory per
+* timer, the peak thread count and lateness percentiles. It exits with 1
+* if a timer fired before the deadline it was given, fired or was removed
+* more than once or never, if the service called into a detached user, if
+* expiries piled up right after a clock jump, or if the p99 lateness is
+* above max_p99_ms, so it can run in CI.
+*
+* Options, given as key=value: users (2000), producers (4), seconds (5),
+* rate (50000 operations per second), burst (5000 timers), reload_every
+* (2 seconds, 0 for none), jump_every (2 seconds, 0 for none), engine
+* (heap or wheel), seed (1), max_p99_ms (50).
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include "journal.h"
+#include "timer_core.h"
+#include "timer_service.h"
+
+using namespace std;
+
+namespace
+{
+struct Options
+{
+    size_t users = 2000u;
+    size_t producers = 4u;
+    unsigned seconds = 5u;
+    size_t rate = 50000u;
+    size_t burst = 5000u;
+    unsigned reload_every = 2u;
+    unsigned jump_every = 2u;
+    string engine = "heap";
+    unsigned seed = 1u;
+    double max_p99_ms = 50.0;
+};
+
+// What producers count, summed up once they are done.
+struct Traffic
+{
+    unsigned long long adds = 0u, removes = 0u, snoozes = 0u, bursts = 0u, reloads = 0u;
+    unsigned long long one_shot_added = 0u;
+};
+
+// What the service thread counts; main only reads it once every user
+// has been detached. per_tick has the one-shot expiries of every 10ms
+// since start.
+struct Expiries
+{
+    unsigned long long expired = 0u, one_shot_fired = 0u, early = 0u, after_detach = 0u;
+    LatencyHistogram lateness;
+    vector<unsigned> per_tick;
+};
+
+constexpr auto TICK = chrono::milliseconds ( 10 );
+// The journal keeps whole milliseconds, so a reloaded timer may come back
+// up to that much earlier than it was asked for.
+constexpr auto JOURNAL_RESOLUTION = chrono::milliseconds ( 1 );
+
+// Timers in all engines, recurring ones included, and the one-shot ones
+// removed, which a reload does on its producer's thread too.
+atomic<long long> live { 0 };
+atomic<unsigned long long> one_shot_removed { 0u };
+Expiries expiries;
+Clock::time_point started;
+// A clock jump takes it exclusively, so it never falls between a
+// reload's journal write and its replay; across a real restart the
+// journal can only go by the wall clock.
+shared_timed_mutex wall_clock;
+
+// A command, as queued by a producer and applied by drain_requests.
+struct Change
+{
+    enum class Kind
+    {
+        add,
+        remove,
+        move
+    };
+
+    Kind kind = Kind::add;
+    unsigned id = 0u;
+    Clock::time_point deadline;
+    Clock::duration interval { };   // add
+    bool cron = false;              // add: every minute
+};
+
+// One CAlarm's worth of state. Only its producer touches next_id and
+// recent, which holds ids to remove or snooze; some of them will have
+// expired by then, just like in real use.
+struct User : TimerClient
+{
+    // The deadline a one-shot timer was last given by add or snooze, and
+    // whether a reload re-anchored it since.
+    struct Requested
+    {
+        Clock::time_point deadline;
+        bool reloaded;
+    };
+
+    void expire_timers ( ) override
+    {
+        if ( detached.load ( ) ) ++expiries.after_detach;
+        lock_guard<mutex> hold ( lock );
+        const auto now = Clock::now ( );
+        due.clear ( );
+        const auto fired = timers->pop_due ( now, ALARM_EXPIRY_BATCH, due );
+        for ( const auto &timer : due ) {
+            expiries.lateness.record ( now - timer.get_deadline ( ) );
+            if ( timer.is_recurring ( ) ) continue;
+            const auto it = requested.find ( timer.get_id ( ) );
+            if ( it != requested.end ( ) ) {
+                const auto slack = it->second.reloaded ? Clock::duration ( JOURNAL_RESOLUTION ) : Clock::duration::zero ( );
+                if ( now < it->second.deadline - slack ) ++expiries.early;
+                requested.erase ( it );
+            }
+            ++expiries.one_shot_fired;
+            live.fetch_sub ( 1, memory_order_relaxed );
+            // Cron timers all fire on the minute, so only one-shots count.
+            const auto tick = static_cast<size_t> ( ( now - started ) / TICK );
+            ++expiries.per_tick[ min ( tick, expiries.per_tick.size ( ) - 1 ) ];
+        }
+        expiries.expired += fired;
+        // Still due after a full batch, so it comes back after the others.
+        TimerService::instance ( ).schedule ( this, timers->next_deadline ( ) );
+    }
+    void drain_requests ( ) override
+    {
+        if ( detached.load ( ) ) ++expiries.after_detach;
+        lock_guard<mutex> hold ( lock );
+        apply_requests ( );
+    }
+    // Must be called with lock held; with the service thread only, or
+    // while detached.
+    void apply_requests ( )
+    {
+        static const string reason = "soak";
+        drain_pending.store ( false );
+        const auto old_front = timers->next_deadline ( );
+        while ( changes.consume ( [ this ] ( const Change &change ) {
+            if ( change.kind == Change::Kind::add ) {
+                Timer timer ( reason, chrono::seconds ( 0 ), change.id, change.interval );
+                timer.set_deadline ( change.deadline );
+                if ( change.cron ) timer.set_cron ( every_minute ( ) );
+                if ( !timer.is_recurring ( ) ) requested[ change.id ] = Requested { change.deadline, false };
+                timers->push ( timer );
+                live.fetch_add ( 1, memory_order_relaxed );
+                return;
+            }
+            const auto timer = timers->find ( change.id );
+            if ( !timer ) return;
+            if ( change.kind == Change::Kind::move ) {
+                if ( !timer->is_recurring ( ) ) requested[ change.id ] = Requested { change.deadline, false };
+                timers->reschedule ( change.id, change.deadline );
+                return;
+            }
+            if ( !timer->is_recurring ( ) ) one_shot_removed.fetch_add ( 1u, memory_order_relaxed );
+            requested.erase ( change.id );
+            timers->remove ( change.id );
+            live.fetch_sub ( 1, memory_order_relaxed );
+        } ) ) { }
+        if ( timers->next_deadline ( ) != old_front ) TimerService::instance ( ).schedule ( this, timers->next_deadline ( ) );
+    }
+    void submit ( const Change &change )
+    {
+        changes.push ( change );
+        if ( !drain_pending.exchange ( true ) ) TimerService::instance ( ).post ( this );
+    }
+    static auto every_minute ( ) -> const CronSchedule&
+    {
+        static const auto cron = [ ] ( ) {
+            CronSchedule schedule;
+            size_t consumed = 0u;
+            schedule.parse ( "* * * * *", consumed );
+            return schedule;
+        } ( );
+        return cron;
+    }
+
+    mutex lock;
+    unique_ptr<TimerEngine> timers;
+    MpscQueue<Change> changes;
+    atomic<bool> drain_pending { false };
+    // Set while the user isn't attached, when the service must leave it be.
+    atomic<bool> detached { true };
+    unordered_map<unsigned, Requested> requested;
+    vector<Timer> due;
+    unsigned next_id = 0u;
+    vector<unsigned> recent;
+};
+
+void add ( User &user, Clock::time_point deadline, Clock::duration interval, bool cron, Traffic &traffic )
+{
+    Change change;
+    change.id = ++user.next_id;
+    change.deadline = deadline;
+    change.interval = interval;
+    change.cron = cron;
+    user.submit ( change );
+    if ( user.recent.size ( ) < 64u )
+        user.recent.push_back ( change.id );
+    else
+        user.recent[ change.id % 64u ] = change.id;
+    ++traffic.adds;
+    if ( interval == Clock::duration::zero ( ) && !cron ) ++traffic.one_shot_added;
+}
+
+// The first minute boundary from now, read off the wall clock.
+auto next_minute ( Clock::time_point now ) -> Clock::time_point
+{
+    const auto wall_now = wall_time ( );
+    return now + chrono::seconds ( User::every_minute ( ).next_fire ( static_cast<time_t> ( wall_now ) ) - wall_now );
+}
+
+// What CAlarm does across a module reload: the old instance detaches and
+// journals its timers, the new one replays the journal at path and
+// re-anchors the wall-clock end times onto the monotonic clock.
+void reload ( User &user, const string &path, Traffic &traffic )
+{
+    auto &service = TimerService::instance ( );
+    service.detach ( &user );
+    user.detached.store ( true );
+    {
+        shared_lock<shared_timed_mutex> steady ( wall_clock );
+        lock_guard<mutex> hold ( user.lock );
+        // Changes that were still queued, as the module's destructor does.
+        user.apply_requests ( );
+        {
+            TimerJournal journal;
+            vector<TimerJournal::Entry> stale;
+            unsigned last_id = 0u;
+            std::remove ( path.c_str ( ) );
+            journal.open ( path, stale, last_id );
+            journal.compact ( user.next_id, [ &user ] ( auto emit ) {
+                user.timers->for_each ( [ &emit ] ( const Timer &t ) {
+                    const auto interval = chrono::duration_cast<chrono::milliseconds> ( t.get_interval ( ) ).count ( );
+                    emit ( t.get_id ( ), t.get_end_time_ms ( ), interval, t.get_cron ( ).valid ( ) ? t.get_cron ( ).to_string ( ) : string ( ),
+                           t.get_reason ( ), t.get_reason_length ( ), t.get_network ( ), t.get_channel ( ) );
+                } );
+            } );
+        }
+        TimerJournal journal;
+        vector<TimerJournal::Entry> saved;
+        unsigned last_id = 0u;
+        journal.open ( path, saved, last_id );
+        const auto now = wall_time_ms ( );
+        vector<Timer> restored;
+        restored.reserve ( saved.size ( ) );
+        for ( const auto &entry : saved ) {
+            restored.emplace_back ( entry.reason, chrono::milliseconds ( entry.end_ms - now ), entry.id,
+                                    chrono::milliseconds ( entry.interval_ms ) );
+            if ( !entry.cron.empty ( ) ) restored.back ( ).set_cron ( User::every_minute ( ) );
+            const auto it = user.requested.find ( entry.id );
+            if ( it != user.requested.end ( ) ) it->second.reloaded = true;
+        }
+        user.timers->assign ( restored );
+    }
+    user.detached.store ( false );
+    service.attach ( &user );
+    {
+        lock_guard<mutex> hold ( user.lock );
+        service.schedule ( &user, user.timers->next_deadline ( ) );
+    }
+    ++traffic.reloads;
+}
+
+// Runs the traffic of users [ first, last ) until stop.
+void produce ( const Options &options, vector<User> &users, size_t first, size_t last, size_t index,
+               const string &journal, Clock::time_point start, Clock::time_point stop, Traffic &traffic )
+{
+    mt19937 random ( options.seed * 7919u + static_cast<unsigned> ( index ) );
+    uniform_int_distribution<size_t> pick ( first, last - 1 );
+    uniform_int_distribution<int> delay_ms ( 1, 2000 );
+    uniform_int_distribution<int> percent ( 0, 99 );
+    const auto rate = static_cast<double> ( options.rate ) / options.producers;
+    unsigned long long done = 0u;
+    const auto burst = options.burst / options.producers;
+    const auto span = last - first;
+    unsigned second = 0u;
+    for ( auto slice = start; slice < stop; ) {
+        const auto now = Clock::now ( );
+        // Catches up with the rate when a slice overslept.
+        const auto target = static_cast<unsigned long long> ( chrono::duration<double> ( now - start ).count ( ) * rate );
+        for ( ; done < target; ++done ) {
+            auto &user = users[ pick ( random ) ];
+            const auto roll = percent ( random );
+            const auto deadline = now + chrono::milliseconds ( delay_ms ( random ) );
+            if ( roll < 2 ) {
+                add ( user, deadline, chrono::milliseconds ( 100 + delay_ms ( random ) / 4 ), false, traffic );
+            } else if ( roll < 3 ) {
+                add ( user, next_minute ( now ), chrono::milliseconds ( 0 ), true, traffic );
+            } else if ( roll < 60 ) {
+                add ( user, deadline, chrono::milliseconds ( 0 ), false, traffic );
+            } else if ( !user.recent.empty ( ) ) {
+                Change change;
+                change.kind = roll < 80 ? Change::Kind::remove : Change::Kind::move;
+                change.id = user.recent[ random ( ) % user.recent.size ( ) ];
+                change.deadline = deadline;
+                user.submit ( change );
+                ++( roll < 80 ? traffic.removes : traffic.snoozes );
+            }
+        }
+        // Once a second the burst, all due on the same instant in every
+        // producer, and every reload_every seconds a tenth of our users are
+        // reloaded.
+        const auto elapsed = static_cast<unsigned> ( chrono::duration_cast<chrono::seconds> ( now - start ).count ( ) );
+        if ( elapsed >= second ) {
+            ++second;
+            const auto at = start + chrono::seconds ( second + 1 );
+            for ( size_t i = 0; i < burst; ++i ) add ( users[ first + i % span ], at, chrono::milliseconds ( 0 ), false, traffic );
+            ++traffic.bursts;
+            if ( options.reload_every > 0 && second % options.reload_every == 0 )
+                for ( size_t i = first + second % 10; i < last; i += 10 ) reload ( users[ i ], journal, traffic );
+        }
+        slice += chrono::milliseconds ( 1 );
+        this_thread::sleep_until ( slice );
+    }
+}
+
+// Resident memory in bytes and the thread count, from /proc; 0 where
+// that isn't available.
+auto resident_bytes ( ) -> long long
+{
+    long long pages = 0, resident = 0;
+    ifstream statm ( "/proc/self/statm" );
+    if ( !( statm >> pages >> resident ) ) return 0;
+    return resident * sysconf ( _SC_PAGESIZE );
+}
+auto thread_count ( ) -> long long
+{
+    ifstream status ( "/proc/self/status" );
+    string line;
+    while ( getline ( status, line ) )
+        if ( line.compare ( 0, 8, "Threads:" ) == 0 ) return atoll ( line.c_str ( ) + 8 );
+    return 0;
+}
+
+auto parse_options ( int argc, char **argv, Options &options ) -> bool
+{
+    for ( int i = 1; i < argc; ++i ) {
+        const string arg = argv[ i ];
+        const auto equals = arg.find ( '=' );
+        if ( equals == string::npos ) return false;
+        const auto key = arg.substr ( 0, equals );
+        const auto value = arg.substr ( equals + 1 );
+        const auto number = strtoull ( value.c_str ( ), nullptr, 10 );
+        if ( key == "users" ) options.users = number;
+        else if ( key == "producers" ) options.producers = number;
+        else if ( key == "seconds" ) options.seconds = static_cast<unsigned> ( number );
+        else if ( key == "rate" ) options.rate = number;
+        else if ( key == "burst" ) options.burst = number;
+        else if ( key == "reload_every" ) options.reload_every = static_cast<unsigned> ( number );
+        else if ( key == "jump_every" ) options.jump_every = static_cast<unsigned> ( number );
+        else if ( key == "engine" ) options.engine = value;
+        else if ( key == "seed" ) options.seed = static_cast<unsigned> ( number );
+        else if ( key == "max_p99_ms" ) options.max_p99_ms = atof ( value.c_str ( ) );
+        else return false;
+    }
+    return options.users > 0 && options.producers > 0 && options.producers <= options.users &&
+           options.seconds > 0 && make_timer_engine ( options.engine ) != nullptr;
+}
+} // namespace
+
+int main ( int argc, char **argv )
+{
+    Options options;
+    if ( !parse_options ( argc, argv, options ) ) {
+        fprintf ( stderr, "usage: %s [users=N] [producers=N] [seconds=N] [rate=N] [burst=N] [reload_every=N] "
+                  "[jump_every=N] [engine=heap|wheel] [seed=N] [max_p99_ms=X]\n", argv[ 0 ] );
+        return 2;
+    }
+    char directory[] = "/tmp/timer_soak.XXXXXX";
+    if ( !mkdtemp ( directory ) ) {
+        perror ( "mkdtemp" );
+        return 2;
+    }
+    // Room for the run and the wait for the last timers after it.
+    expiries.per_tick.assign ( ( options.seconds + 10u ) * 100u, 0u );
+    started = Clock::now ( );
+    vector<User> users ( options.users );
+    for ( auto &user : users ) {
+        user.timers = make_timer_engine ( options.engine );
+        user.detached.store ( false );
+        TimerService::instance ( ).attach ( &user );
+    }
+    const auto base_rss = resident_bytes ( );
+
+    vector<Traffic> traffic ( options.producers );
+    vector<string> journals;
+    vector<thread> producers;
+    const auto start = Clock::now ( );
+    const auto stop = start + chrono::seconds ( options.seconds );
+    for ( size_t i = 0; i < options.producers; ++i ) journals.push_back ( string ( directory ) + "/producer" + to_string ( i ) + ".journal" );
+    for ( size_t i = 0; i < options.producers; ++i ) {
+        const auto first = users.size ( ) * i / options.producers;
+        const auto last = users.size ( ) * ( i + 1 ) / options.producers;
+        producers.emplace_back ( [ &, first, last, i ] ( ) {
+            produce ( options, users, first, last, i, journals[ i ], start, stop, traffic[ i ] );
+        } );
+    }
+    long long peak_rss = base_rss, peak_live = 0, peak_threads = 0;
+    // Half a second off the bursts and reloads, which come on the second.
+    vector<size_t> jumps;
+    auto next_jump = start + chrono::seconds ( options.jump_every ) + chrono::milliseconds ( 500 );
+    while ( Clock::now ( ) < stop ) {
+        this_thread::sleep_for ( chrono::milliseconds ( 50 ) );
+        const auto now = Clock::now ( );
+        if ( options.jump_every > 0 && now >= next_jump && now < stop ) {
+            lock_guard<shared_timed_mutex> jump ( wall_clock );
+            wall_clock_offset ( ).fetch_add ( jumps.size ( ) % 2 == 0 ? -3600 : 3600 );
+            jumps.push_back ( static_cast<size_t> ( ( Clock::now ( ) - started ) / TICK ) );
+            next_jump += chrono::seconds ( options.jump_every );
+        }
+        peak_rss = max ( peak_rss, resident_bytes ( ) );
+        peak_live = max ( peak_live, live.load ( memory_order_relaxed ) );
+        peak_threads = max ( peak_threads, thread_count ( ) );
+    }
+    for ( auto &producer : producers ) producer.join ( );
+    const auto ran = chrono::duration<double> ( Clock::now ( ) - start ).count ( );
+
+    // Lets the service apply what is still queued, then drops the
+    // recurring timers and waits for the rest to run out; none is further
+    // out than the last burst.
+    for ( auto &user : users ) {
+        while ( user.drain_pending.load ( ) ) this_thread::sleep_for ( chrono::milliseconds ( 1 ) );
+        lock_guard<mutex> lock ( user.lock );
+        vector<unsigned> recurring;
+        user.timers->for_each ( [ &recurring ] ( const Timer &timer ) {
+            if ( timer.is_recurring ( ) ) recurring.push_back ( timer.get_id ( ) );
+        } );
+        for ( const auto id : recurring ) user.timers->remove ( id );
+        live.fetch_sub ( static_cast<long long> ( recurring.size ( ) ), memory_order_relaxed );
+    }
+    const auto give_up = Clock::now ( ) + chrono::seconds ( 5 );
+    while ( live.load ( ) > 0 && Clock::now ( ) < give_up ) this_thread::sleep_for ( chrono::milliseconds ( 10 ) );
+    // All producers detach their users at once; the last detach stops the
+    // service thread.
+    producers.clear ( );
+    for ( size_t i = 0; i < options.producers; ++i ) {
+        const auto first = users.size ( ) * i / options.producers;
+        const auto last = users.size ( ) * ( i + 1 ) / options.producers;
+        producers.emplace_back ( [ &users, first, last ] ( ) {
+            for ( auto user = first; user < last; ++user ) {
+                TimerService::instance ( ).detach ( &users[ user ] );
+                users[ user ].detached.store ( true );
+            }
+        } );
+    }
+    for ( auto &producer : producers ) producer.join ( );
+    for ( const auto &journal : journals ) std::remove ( journal.c_str ( ) );
+    rmdir ( directory );
+
+    Traffic total;
+    for ( const auto &t : traffic ) {
+        total.adds += t.adds;
+        total.removes += t.removes;
+        total.snoozes += t.snoozes;
+        total.bursts += t.bursts;
+        total.reloads += t.reloads;
+        total.one_shot_added += t.one_shot_added;
+    }
+    const auto &lateness = expiries.lateness;
+    const auto operations = total.adds + total.removes + total.snoozes;
+    printf ( "%s engine, %zu users, %zu producers, %.1fs, seed %u\n", options.engine.c_str ( ), options.users,
+             options.producers, ran, options.seed );
+    printf ( "operations   %llu (%.0f/s): %llu adds, %llu removes, %llu snoozes, %llu bursts, %llu user reloads\n",
+             operations, operations / ran, total.adds, total.removes, total.snoozes, total.bursts, total.reloads );
+    printf ( "expired      %llu (%.0f/s)\n", expiries.expired, expiries.expired / ran );
+    printf ( "clock jumps  %zu of an hour\n", jumps.size ( ) );
+    if ( base_rss > 0 && peak_live > 0 )
+        printf ( "memory       %.0f bytes per timer (%lld timers at most, %.1f MB resident at most)\n",
+                 static_cast<double> ( peak_rss - base_rss ) / peak_live, peak_live, peak_rss / 1048576.0 );
+    if ( peak_threads > 0 ) printf ( "threads      %lld at most\n", peak_threads );
+    printf ( "lateness     p50 %.3fms  p90 %.3fms  p99 %.3fms  p99.9 %.3fms  max %.3fms\n",
+             lateness.percentile_us ( 50 ) / 1000.0, lateness.percentile_us ( 90 ) / 1000.0,
+             lateness.percentile_us ( 99 ) / 1000.0, lateness.percentile_us ( 99.9 ) / 1000.0, lateness.max_us ( ) / 1000.0 );
+
+    auto failed = false;
+    if ( expiries.early > 0 ) {
+        printf ( "FAIL: %llu timers fired early\n", expiries.early );
+        failed = true;
+    }
+    if ( expiries.after_detach > 0 ) {
+        printf ( "FAIL: the service called into a detached user %llu times\n", expiries.after_detach );
+        failed = true;
+    }
+    // A jump may not make one-shots fire faster in the 100ms after it than
+    // before; the slack covers the traffic going up and down.
+    const auto &ticks = expiries.per_tick;
+    for ( const auto jump : jumps ) {
+        if ( jump < 10u || jump + 10u > ticks.size ( ) ) continue;
+        const auto before = accumulate ( ticks.begin ( ) + jump - 10, ticks.begin ( ) + jump, 0ull );
+        const auto after = accumulate ( ticks.begin ( ) + jump, ticks.begin ( ) + jump + 10, 0ull );
+        if ( after > 2u * before + options.burst / 10u + 100u ) {
+            printf ( "FAIL: %llu timers fired in the 100ms after a clock jump, %llu in the 100ms before\n", after, before );
+            failed = true;
+        }
+    }
+    if ( expiries.one_shot_fired + one_shot_removed.load ( ) != total.one_shot_added ) {
+        printf ( "FAIL: %llu one-shot timers added, but %llu fired and %llu were removed\n", total.one_shot_added,
+                 expiries.one_shot_fired, one_shot_removed.load ( ) );
+        failed = true;
+    }
+    if ( lateness.percentile_us ( 99 ) > options.max_p99_ms * 1000.0 ) {
+        printf ( "FAIL: p99 lateness above %.3fms\n", options.max_p99_ms );
+        failed = true;
+    }
+    return failed ? 1 : 0;
+}
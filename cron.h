@@ -0,0 +1,198 @@
+/*
+* Cron style schedules for the alarm module.
+* Copyright (c) 2017, Alexander Schwarz
+* License: BSD 3-clause License
+*
+* An expression is compiled once into one bitset per field; after that
+* only the next fire time is ever computed, so a schedule costs the timer
+* queue exactly one deadline no matter how often it fires.
+*/
+
+#ifndef ALARM_CRON_H
+#define ALARM_CRON_H
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include "local_time.h"
+
+class CronSchedule
+{
+public:
+    // Parses "<minute> <hour> <day of month> <month> <day of week>". Each
+    // field is *, a number, a range a-b, any of those with a /step, or a
+    // comma separated list of them. Months and weekdays may also be given
+    // by their three letter English names; Sunday is 0 or 7. On success
+    // consumed is set to the length of the expression within text.
+    auto parse ( const std::string &text, size_t &consumed ) -> bool
+    {
+        *this = CronSchedule ( );
+        size_t pos = 0;
+        for ( size_t field = 0; field < FIELDS; ++field ) {
+            while ( pos < text.size ( ) && text[ pos ] == ' ' ) ++pos;
+            const auto begin = pos;
+            while ( pos < text.size ( ) && text[ pos ] != ' ' ) ++pos;
+            if ( begin == pos || !parse_field ( field, text.substr ( begin, pos - begin ) ) ) return false;
+        }
+        // Both 0 and 7 mean Sunday.
+        if ( bits_[ WEEKDAY ] & ( 1ULL << 7 ) ) bits_[ WEEKDAY ] = ( bits_[ WEEKDAY ] | 1u ) & ~( 1ULL << 7 );
+        consumed = pos;
+        return true;
+    }
+    auto valid ( ) const -> bool
+    {
+        return bits_[ MINUTE ] != 0;
+    }
+    // First matching minute strictly after after, in local time, or 0 if
+    // the schedule never matches (e.g. "0 0 30 2 *").
+    auto next_fire ( time_t after ) const -> time_t
+    {
+        local_time::ZoneScope scope ( "" );
+        tm t;
+        localtime_r ( &after, &t );
+        t.tm_sec = 0;
+        t.tm_min += 1;
+        t.tm_isdst = -1;
+        mktime ( &t );
+        // Five years covers every combination of month and weekday.
+        const auto last_year = t.tm_year + 5;
+        while ( t.tm_year <= last_year ) {
+            if ( !has ( MONTH, t.tm_mon + 1 ) ) {
+                t.tm_mon += 1;
+                t.tm_mday = 1;
+                t.tm_hour = 0;
+                t.tm_min = 0;
+            } else if ( !day_matches ( t ) ) {
+                t.tm_mday += 1;
+                t.tm_hour = 0;
+                t.tm_min = 0;
+            } else if ( !has ( HOUR, t.tm_hour ) ) {
+                t.tm_hour += 1;
+                t.tm_min = 0;
+            } else if ( !has ( MINUTE, t.tm_min ) ) {
+                t.tm_min += 1;
+            } else {
+                t.tm_isdst = -1;
+                return mktime ( &t );
+            }
+            t.tm_isdst = -1;
+            mktime ( &t );
+        }
+        return 0;
+    }
+    // Canonical form of the expression, e.g. "0,30 9 * * 1,2,3,4,5".
+    auto to_string ( ) const -> std::string
+    {
+        std::string text;
+        for ( size_t field = 0; field < FIELDS; ++field ) {
+            if ( field > 0 ) text += ' ';
+            if ( !restricted ( field ) ) {
+                text += '*';
+                continue;
+            }
+            bool first = true;
+            for ( unsigned value = low ( field ); value <= high ( field ); ++value ) {
+                if ( !has ( field, value ) ) continue;
+                if ( !first ) text += ',';
+                text += std::to_string ( value );
+                first = false;
+            }
+        }
+        return text;
+    }
+
+private:
+    enum Field
+    {
+        MINUTE,
+        HOUR,
+        DAY,
+        MONTH,
+        WEEKDAY,
+        FIELDS
+    };
+    static constexpr auto low ( size_t field ) -> unsigned
+    {
+        return field == DAY || field == MONTH ? 1u : 0u;
+    }
+    static constexpr auto high ( size_t field ) -> unsigned
+    {
+        return field == MINUTE ? 59u : field == HOUR ? 23u : field == DAY ? 31u : field == MONTH ? 12u : 7u;
+    }
+
+    auto has ( size_t field, unsigned value ) const -> bool
+    {
+        return ( bits_[ field ] >> value ) & 1u;
+    }
+    auto full ( size_t field ) const -> uint64_t
+    {
+        return ( ( 2ULL << high ( field ) ) - 1 ) & ~( ( 1ULL << low ( field ) ) - 1 );
+    }
+    auto restricted ( size_t field ) const -> bool
+    {
+        const auto all = field == WEEKDAY ? full ( field ) & ~( 1ULL << 7 ) : full ( field );
+        return bits_[ field ] != all;
+    }
+    // Like cron: if both day fields are restricted, either may match.
+    auto day_matches ( const tm &t ) const -> bool
+    {
+        const auto day = has ( DAY, t.tm_mday );
+        const auto weekday = has ( WEEKDAY, t.tm_wday );
+        if ( restricted ( DAY ) && restricted ( WEEKDAY ) ) return day || weekday;
+        return day && weekday;
+    }
+    static auto parse_value ( size_t field, const std::string &text, unsigned &value ) -> bool
+    {
+        static const char *const MONTHS = "janfebmaraprmayjunjulaugsepoctnovdec";
+        static const char *const WEEKDAYS = "sunmontuewedthufrisat";
+        if ( text.size ( ) == 3 && ( field == MONTH || field == WEEKDAY ) ) {
+            const auto names = field == MONTH ? MONTHS : WEEKDAYS;
+            for ( unsigned i = 0; names[ i * 3 ] != '\0'; ++i ) {
+                if ( strncasecmp ( names + i * 3, text.c_str ( ), 3 ) == 0 ) {
+                    value = field == MONTH ? i + 1 : i;
+                    return true;
+                }
+            }
+            return false;
+        }
+        if ( text.empty ( ) || text.size ( ) > 2 ) return false;
+        value = 0;
+        for ( const auto c : text ) {
+            if ( c < '0' || c > '9' ) return false;
+            value = value * 10 + ( c - '0' );
+        }
+        return value >= low ( field ) && value <= high ( field );
+    }
+    auto parse_field ( size_t field, const std::string &text ) -> bool
+    {
+        for ( size_t begin = 0; begin <= text.size ( ); ) {
+            auto end = text.find ( ',', begin );
+            if ( end == std::string::npos ) end = text.size ( );
+            auto item = text.substr ( begin, end - begin );
+            begin = end + 1;
+
+            unsigned step = 1u;
+            const auto slash = item.find ( '/' );
+            if ( slash != std::string::npos ) {
+                if ( !parse_value ( MINUTE, item.substr ( slash + 1 ), step ) || step == 0 ) return false;
+                item.resize ( slash );
+            }
+            unsigned first = low ( field ), last = high ( field );
+            if ( item != "*" ) {
+                const auto dash = item.find ( '-' );
+                if ( !parse_value ( field, item.substr ( 0, dash ), first ) ) return false;
+                last = first;
+                if ( dash != std::string::npos && !parse_value ( field, item.substr ( dash + 1 ), last ) ) return false;
+                if ( dash == std::string::npos && slash != std::string::npos ) last = high ( field );
+                if ( last < first ) return false;
+            }
+            for ( auto value = first; value <= last; value += step ) bits_[ field ] |= 1ULL << value;
+        }
+        return true;
+    }
+
+    uint64_t bits_[ FIELDS ] = { };
+};
+
+#endif // ALARM_CRON_H
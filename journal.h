@@ -0,0 +1,213 @@
+/*
+* Append-only on-disk journal of the alarm module's timers.
+* Copyright (c) 2017, Alexander Schwarz
+* License: BSD 3-clause License
+*
+* Every change is appended as one line:
+*   N <last id>                   written at the top of a compacted journal
+*   A <id> <end time> <reason>    timer added
+*   P <id> <end time> <interval ms> <reason>
+*                                 recurring timer added
+*   C <id> <end time> <5 cron fields> <reason>
+*                                 scheduled timer added
+*   T <id> <network> <target>     follows the add record of a timer that
+*                                 is posted to a channel or nick
+*   M <id> <end time>             timer moved to a new end time
+*   R <id>                        timer removed by the user
+*   E <id>                        timer expired
+* End times are Unix milliseconds, so a timer comes back from a reload
+* with its deadline to the millisecond. Journals from before that have
+* Unix seconds, told apart by size: no end time in milliseconds since
+* 1973 is below SECONDS_BEFORE, and in seconds that is the year 5138.
+* Once the journal holds a lot more records than live timers it is
+* rewritten (to a temporary file that is renamed over the old one) with
+* just the live timers.
+*/
+
+#ifndef ALARM_JOURNAL_H
+#define ALARM_JOURNAL_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class TimerJournal
+{
+public:
+    struct Entry
+    {
+        unsigned id;
+        long long end_ms;
+        long long interval_ms;
+        std::string cron;
+        std::string reason;
+        std::string network;
+        std::string channel;
+    };
+
+    // Replays the journal at path into live (in no particular order) and
+    // leaves it open for appending. last_id is raised to the highest id
+    // the journal has ever seen.
+    auto open ( const std::string &path, std::vector<Entry> &live, unsigned &last_id ) -> bool
+    {
+        path_ = path;
+        records_ = 0u;
+        std::unordered_map<unsigned, Entry> timers;
+        std::ifstream in ( path_ );
+        std::string line;
+        while ( getline ( in, line ) ) {
+            ++records_;
+            if ( line.size ( ) < 3 || line[ 1 ] != ' ' ) continue;
+            char *end = nullptr;
+            const auto id = static_cast<unsigned> ( strtoul ( line.c_str ( ) + 2, &end, 10 ) );
+            if ( end == line.c_str ( ) + 2 ) continue;
+            if ( id > last_id ) last_id = id;
+            switch ( line[ 0 ] ) {
+            case 'A':
+            case 'P':
+            case 'C': {
+                char *reason = nullptr;
+                const auto end_ms = to_ms ( strtoll ( end, &reason, 10 ) );
+                if ( reason == end || *reason != ' ' ) break;
+                auto interval_ms = 0LL;
+                std::string cron;
+                if ( line[ 0 ] == 'P' ) {
+                    char *after = nullptr;
+                    interval_ms = strtoll ( reason, &after, 10 );
+                    if ( after == reason || *after != ' ' || interval_ms <= 0 ) break;
+                    reason = after;
+                } else if ( line[ 0 ] == 'C' ) {
+                    auto after = reason;
+                    for ( int field = 0; field < 5 && after; ++field ) after = strchr ( after + 1, ' ' );
+                    if ( !after ) break;
+                    cron.assign ( reason + 1, after );
+                    reason = after;
+                }
+                auto &entry = timers[ id ];
+                entry.id = id;
+                entry.end_ms = end_ms;
+                entry.interval_ms = interval_ms;
+                entry.cron = std::move ( cron );
+                entry.reason.assign ( reason + 1 );
+                break;
+            }
+            case 'T': {
+                const auto it = timers.find ( id );
+                const auto split = end && *end == ' ' ? strchr ( end + 1, ' ' ) : nullptr;
+                if ( it == timers.end ( ) || !split ) break;
+                it->second.network.assign ( end + 1, split );
+                it->second.channel.assign ( split + 1 );
+                break;
+            }
+            case 'M': {
+                const auto it = timers.find ( id );
+                char *after = nullptr;
+                const auto end_ms = to_ms ( strtoll ( end, &after, 10 ) );
+                if ( it != timers.end ( ) && after != end ) it->second.end_ms = end_ms;
+                break;
+            }
+            case 'R':
+            case 'E':
+                timers.erase ( id );
+                break;
+            default:
+                break;
+            }
+        }
+        live.reserve ( live.size ( ) + timers.size ( ) );
+        for ( auto &t : timers ) live.push_back ( std::move ( t.second ) );
+        out_.open ( path_, std::ios::app );
+        return out_.good ( );
+    }
+    void added ( unsigned id, long long end_ms, long long interval_ms, const std::string &cron,
+                 const char *reason, size_t length, const std::string &network, const std::string &channel )
+    {
+        records_ += write_added ( out_, id, end_ms, interval_ms, cron, reason, length, network, channel );
+    }
+    void moved ( unsigned id, long long end_ms )
+    {
+        out_ << "M " << id << ' ' << end_ms << '\n';
+        ++records_;
+    }
+    void removed ( unsigned id )
+    {
+        out_ << "R " << id << '\n';
+        ++records_;
+    }
+    void expired ( unsigned id )
+    {
+        out_ << "E " << id << '\n';
+        ++records_;
+    }
+    // Called once per batch of changes.
+    void flush ( )
+    {
+        out_.flush ( );
+    }
+    auto needs_compaction ( size_t live ) const -> bool
+    {
+        return records_ > 2 * live + COMPACT_SLACK;
+    }
+    // for_each_timer ( emit ) must call
+    // emit ( id, end_ms, interval_ms, cron, reason, length, network, channel )
+    // once per live timer.
+    template <typename ForEachTimer>
+    auto compact ( unsigned last_id, ForEachTimer for_each_timer ) -> bool
+    {
+        const auto tmp_path = path_ + ".new";
+        std::ofstream tmp ( tmp_path, std::ios::trunc );
+        tmp << "N " << last_id << '\n';
+        size_t records = 1u;
+        for_each_timer ( [ &tmp, &records ] ( unsigned id, long long end_ms, long long interval_ms,
+                                              const std::string &cron, const char *reason, size_t length,
+                                              const std::string &network, const std::string &channel ) {
+            records += write_added ( tmp, id, end_ms, interval_ms, cron, reason, length, network, channel );
+        } );
+        tmp.close ( );
+        if ( !tmp || std::rename ( tmp_path.c_str ( ), path_.c_str ( ) ) != 0 ) {
+            std::remove ( tmp_path.c_str ( ) );
+            return false;
+        }
+        out_.close ( );
+        out_.clear ( );
+        out_.open ( path_, std::ios::app );
+        records_ = records;
+        return out_.good ( );
+    }
+
+private:
+    static constexpr size_t COMPACT_SLACK = 64u;
+    static constexpr long long SECONDS_BEFORE = 100000000000LL;
+
+    static auto to_ms ( long long end_time ) -> long long
+    {
+        return end_time < SECONDS_BEFORE ? end_time * 1000 : end_time;
+    }
+
+    // Returns the number of records written.
+    static auto write_added ( std::ostream &out, unsigned id, long long end_ms, long long interval_ms,
+                              const std::string &cron, const char *reason, size_t length,
+                              const std::string &network, const std::string &channel ) -> size_t
+    {
+        if ( !cron.empty ( ) )
+            out << "C " << id << ' ' << end_ms << ' ' << cron << ' ';
+        else if ( interval_ms > 0 )
+            out << "P " << id << ' ' << end_ms << ' ' << interval_ms << ' ';
+        else
+            out << "A " << id << ' ' << end_ms << ' ';
+        out.write ( reason, length ) << '\n';
+        if ( network.empty ( ) ) return 1u;
+        out << "T " << id << ' ' << network << ' ' << channel << '\n';
+        return 2u;
+    }
+
+    std::string path_;
+    std::ofstream out_;
+    size_t records_ = 0u;
+};
+
+#endif // ALARM_JOURNAL_H
@@ -0,0 +1,94 @@
+/*
+* Wall-clock conversions in a named time zone for the alarm module.
+* Copyright (c) 2017, Alexander Schwarz
+* License: BSD 3-clause License
+*
+* libc only converts in the zone named by TZ, so a conversion in a user's
+* zone (e.g. "Europe/Berlin") swaps TZ in and back out. That affects the
+* whole process, hence the module's own conversions, cron's included, are
+* serialized by zone_mutex ( ). An empty zone means the server's own.
+*
+* ZNC itself does the same swap in CUtils::FormatTime without this lock,
+* on its main thread, so everything here has to run on that thread too:
+* calling into libc's time zone code while TZ is being set elsewhere is
+* undefined. The thread backend's service thread therefore only ever
+* gets absolute deadlines; after it fires a cron timer, ZNC's thread works
+* out the next one (CAlarm::check_cron).
+*/
+
+#ifndef ALARM_LOCAL_TIME_H
+#define ALARM_LOCAL_TIME_H
+
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <string>
+
+namespace local_time
+{
+inline auto zone_mutex ( ) -> std::mutex&
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+// Holds zone_mutex ( ) and, unless zone is empty, has TZ set to zone
+// for as long as it lives.
+class ZoneScope
+{
+public:
+    explicit ZoneScope ( const std::string &zone ) : lock_ ( zone_mutex ( ) ), swapped_ ( !zone.empty ( ) )
+    {
+        if ( !swapped_ ) return;
+        const auto old = getenv ( "TZ" );
+        had_zone_ = old != nullptr;
+        if ( had_zone_ ) old_zone_ = old;
+        setenv ( "TZ", zone.c_str ( ), 1 );
+        tzset ( );
+    }
+    ZoneScope ( const ZoneScope& ) = delete;
+    auto operator= ( const ZoneScope& ) -> ZoneScope& = delete;
+    ~ZoneScope ( )
+    {
+        if ( !swapped_ ) return;
+        if ( had_zone_ )
+            setenv ( "TZ", old_zone_.c_str ( ), 1 );
+        else
+            unsetenv ( "TZ" );
+        tzset ( );
+    }
+
+private:
+    std::lock_guard<std::mutex> lock_;
+    bool swapped_;
+    bool had_zone_ = false;
+    std::string old_zone_;
+};
+
+// The broken down local time t in zone as a time_t, -1 if it doesn't
+// exist there (Feb 30th, or skipped by a daylight saving change).
+inline auto to_epoch ( const tm &t, const std::string &zone ) -> time_t
+{
+    auto normalized = t;
+    normalized.tm_isdst = -1;
+    ZoneScope scope ( zone );
+    const auto when = mktime ( &normalized );
+    if ( normalized.tm_mday != t.tm_mday || normalized.tm_hour != t.tm_hour || normalized.tm_min != t.tm_min ) return -1;
+    return when;
+}
+
+// strftime of when in zone.
+inline auto format ( time_t when, const std::string &zone, const char *format ) -> std::string
+{
+    char text[ 64 ];
+    tm t;
+    size_t length = 0u;
+    {
+        ZoneScope scope ( zone );
+        if ( localtime_r ( &when, &t ) ) length = strftime ( text, sizeof text, format, &t );
+    }
+    return std::string ( text, length );
+}
+} // end of namespace local_time
+
+#endif // ALARM_LOCAL_TIME_H
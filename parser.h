@@ -0,0 +1,233 @@
+/*
+* Duration and id parsing for the alarm module.
+* Copyright (c) 2017, Alexander Schwarz
+* License: BSD 3-clause License
+*
+* Nothing in here depends on ZNC, so it can be benchmarked on its own
+* (see bench/parse_bench.cpp).
+*/
+
+#ifndef ALARM_PARSER_H
+#define ALARM_PARSER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace parser
+{
+enum class ParseError
+{
+    none,
+    no_duration,
+    duplicate_unit,
+    out_of_range
+};
+
+struct Duration
+{
+    long long milliseconds;
+    ParseError error;
+};
+
+// Longest duration that may be requested, the 999 days the old parser
+// allowed, in milliseconds.
+constexpr long long DURATION_MAX = 999LL * 86400 * 1000;
+
+constexpr auto is_space ( char c ) -> bool
+{
+    return c == ' ' || c == '\t';
+}
+constexpr auto is_digit ( char c ) -> bool
+{
+    return c >= '0' && c <= '9';
+}
+// Length of the unit starting at text[ pos ] ("ms" or one of d, h, m, s),
+// 0 if there is none.
+constexpr auto unit_length ( const char *text, std::size_t pos, std::size_t end ) -> std::size_t
+{
+    return pos + 1 < end && text[ pos ] == 'm' && text[ pos + 1 ] == 's' ? 2u
+         : pos < end && ( text[ pos ] == 'd' || text[ pos ] == 'h' || text[ pos ] == 'm' || text[ pos ] == 's' ) ? 1u
+         : 0u;
+}
+constexpr auto unit_milliseconds ( char c, std::size_t length ) -> long long
+{
+    return length == 2 ? 1 : c == 's' ? 1000 : c == 'm' ? 60000 : c == 'h' ? 3600000 : 86400000;
+}
+constexpr auto unit_bit ( char c, std::size_t length ) -> unsigned
+{
+    return length == 2 ? 16u : c == 's' ? 1u : c == 'm' ? 2u : c == 'h' ? 4u : 8u;
+}
+
+// Single pass over the "xxd xxh xxm xxs xxms" grammar: every whitespace
+// separated word that consists only of <number><unit> groups adds to the
+// duration (so "1h30m" and "1h 30m" are the same), any other word is
+// treated as part of the reason. Each unit may be given only once.
+constexpr auto parse_duration ( const char *text, std::size_t length ) -> Duration
+{
+    long long total = 0;
+    unsigned seen_units = 0u;
+    bool found = false;
+    std::size_t pos = 0;
+    while ( pos < length ) {
+        while ( pos < length && is_space ( text[ pos ] ) ) ++pos;
+        const auto word_begin = pos;
+        while ( pos < length && !is_space ( text[ pos ] ) ) ++pos;
+        const auto word_end = pos;
+        if ( word_begin == word_end ) break;
+
+        long long word_total = 0;
+        unsigned word_units = 0u;
+        bool is_duration = true;
+        bool overflow = false;
+        for ( auto i = word_begin; i < word_end && is_duration; ) {
+            long long value = 0;
+            const auto digits_begin = i;
+            // Past DURATION_MAX the digits are only skipped, so that any
+            // number of them can't overflow value.
+            while ( i < word_end && is_digit ( text[ i ] ) ) {
+                if ( !overflow ) value = value * 10 + ( text[ i ] - '0' );
+                if ( value > DURATION_MAX ) overflow = true;
+                ++i;
+            }
+            const auto unit = unit_length ( text, i, word_end );
+            if ( i == digits_begin || unit == 0 ) {
+                is_duration = false;
+                break;
+            }
+            const auto bit = unit_bit ( text[ i ], unit );
+            if ( ( word_units | seen_units ) & bit ) return Duration { 0, ParseError::duplicate_unit };
+            word_units |= bit;
+            if ( value > DURATION_MAX / unit_milliseconds ( text[ i ], unit ) ) overflow = true;
+            if ( !overflow ) word_total += value * unit_milliseconds ( text[ i ], unit );
+            i += unit;
+        }
+        if ( !is_duration ) continue;
+        if ( overflow ) return Duration { 0, ParseError::out_of_range };
+        found = true;
+        seen_units |= word_units;
+        total += word_total;
+        if ( total > DURATION_MAX ) return Duration { 0, ParseError::out_of_range };
+    }
+    if ( !found ) return Duration { 0, ParseError::no_duration };
+    return Duration { total, ParseError::none };
+}
+inline auto parse_duration ( const std::string &text ) -> Duration
+{
+    return parse_duration ( text.data ( ), text.size ( ) );
+}
+
+inline auto error_message ( ParseError error ) -> const char*
+{
+    switch ( error ) {
+    case ParseError::none:
+        return "";
+    case ParseError::no_duration:
+        return "No duration given, use e.g. 1d 2h 3m 4s 500ms.";
+    case ParseError::duplicate_unit:
+        return "Each of d, h, m, s and ms may only be given once.";
+    case ParseError::out_of_range:
+        return "Timers can run for at most 999 days.";
+    }
+    return "";
+}
+
+// First run of digits in text, or 0 (never a valid timer id) if there is
+// none or it does not fit.
+constexpr auto parse_id ( const char *text, std::size_t length ) -> unsigned
+{
+    std::size_t pos = 0;
+    while ( pos < length && !is_digit ( text[ pos ] ) ) ++pos;
+    unsigned long long id = 0;
+    while ( pos < length && is_digit ( text[ pos ] ) ) {
+        id = id * 10 + ( text[ pos++ ] - '0' );
+        if ( id > 0xffffffffULL ) return 0u;
+    }
+    return static_cast<unsigned> ( id );
+}
+inline auto parse_id ( const std::string &text ) -> unsigned
+{
+    return parse_id ( text.data ( ), text.size ( ) );
+}
+
+// Offset of whatever follows the first words whitespace separated words
+// of text, like CString::Token ( words, true ) but without the copy.
+constexpr auto skip_words ( const char *text, std::size_t length, std::size_t words ) -> std::size_t
+{
+    std::size_t pos = 0;
+    while ( pos < length && is_space ( text[ pos ] ) ) ++pos;
+    for ( ; words > 0 && pos < length; --words ) {
+        while ( pos < length && !is_space ( text[ pos ] ) ) ++pos;
+        while ( pos < length && is_space ( text[ pos ] ) ) ++pos;
+    }
+    return pos;
+}
+
+// Every run of digits in text, e.g. "removemany 3, 5 8" gives 3, 5, 8.
+inline auto parse_ids ( const std::string &text ) -> std::vector<unsigned>
+{
+    std::vector<unsigned> ids;
+    for ( std::size_t pos = 0; pos < text.size ( ); ) {
+        while ( pos < text.size ( ) && !is_digit ( text[ pos ] ) ) ++pos;
+        const auto begin = pos;
+        while ( pos < text.size ( ) && is_digit ( text[ pos ] ) ) ++pos;
+        const auto id = parse_id ( text.data ( ) + begin, pos - begin );
+        if ( id != 0u ) ids.push_back ( id );
+    }
+    return ids;
+}
+
+// Writes seconds (clamped at 0) as H:MM:SS into out and returns its
+// length, without allocating.
+inline auto format_hms ( long long seconds, char *out, std::size_t size ) -> std::size_t
+{
+    if ( seconds < 0 ) seconds = 0;
+    const auto written = snprintf ( out, size, "%lld:%02lld:%02lld", seconds / 3600, seconds / 60 % 60, seconds % 60 );
+    return written < 0 ? 0u : std::min<std::size_t> ( written, size - 1 );
+}
+inline auto string_from_secs ( const long long end_time ) -> std::string {
+    char buffer[ 32 ];
+    const auto length = format_hms ( end_time - time ( 0 ), buffer, sizeof buffer );
+    return std::string ( buffer, length );
+}
+// "YYYY-MM-DD HH:MM" after any leading whitespace in text, stored in the
+// date and time fields of t. Returns the length consumed or 0 if text
+// doesn't start with such a date (months 1-12, days 1-31, 00:00-23:59).
+inline auto parse_datetime ( const char *text, std::size_t length, tm &t ) -> std::size_t
+{
+    std::size_t pos = 0;
+    while ( pos < length && is_space ( text[ pos ] ) ) ++pos;
+    // Reads exactly digits digits, then expects separator (unless it is 0).
+    const auto number = [ text, length, &pos ] ( std::size_t digits, char separator, int &value ) {
+        value = 0;
+        for ( std::size_t i = 0; i < digits; ++i, ++pos ) {
+            if ( pos >= length || !is_digit ( text[ pos ] ) ) return false;
+            value = value * 10 + ( text[ pos ] - '0' );
+        }
+        if ( separator == '\0' ) return pos == length || is_space ( text[ pos ] );
+        if ( separator == ' ' ) {
+            if ( pos >= length || !is_space ( text[ pos ] ) ) return false;
+            while ( pos < length && is_space ( text[ pos ] ) ) ++pos;
+            return true;
+        }
+        return pos < length && text[ pos++ ] == separator;
+    };
+    int year = 0, month = 0, day = 0, hour = 0, minute = 0;
+    if ( !number ( 4, '-', year ) || !number ( 2, '-', month ) || !number ( 2, ' ', day ) ||
+         !number ( 2, ':', hour ) || !number ( 2, '\0', minute ) )
+        return 0u;
+    if ( month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 ) return 0u;
+    t = tm ( );
+    t.tm_year = year - 1900;
+    t.tm_mon = month - 1;
+    t.tm_mday = day;
+    t.tm_hour = hour;
+    t.tm_min = minute;
+    return pos;
+}
+} // end of namespace parser
+
+#endif // ALARM_PARSER_H
@@ -0,0 +1,1266 @@
+/*
+* ZNC independent core of the alarm module: the timer type, its queue and
+* the bits of bookkeeping around them.
+* Copyright (c) 2017, Alexander Schwarz
+* License: BSD 3-clause License
+*
+* alarm.cpp wraps this in a CModule; bench/timer_bench.cpp measures it
+* on its own.
+*/
+
+#ifndef ALARM_TIMER_CORE_H
+#define ALARM_TIMER_CORE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cron.h"
+#include "parser.h"
+
+// Timers are scheduled on the monotonic clock, so stepping the wall clock
+// neither fires them early nor holds them back. Wall time is only derived
+// for display and for the journal.
+using Clock = std::chrono::steady_clock;
+constexpr Clock::time_point NO_DEADLINE = Clock::time_point::max ( );
+
+// Whole seconds (rounded up) from now until deadline.
+inline auto seconds_until ( Clock::time_point deadline, Clock::time_point now = Clock::now ( ) ) -> long long
+{
+    return std::chrono::duration_cast<std::chrono::seconds> ( deadline - now + std::chrono::seconds ( 1 ) - Clock::duration ( 1 ) ).count ( );
+}
+
+// Whole milliseconds (rounded up) from now until deadline.
+inline auto milliseconds_until ( Clock::time_point deadline, Clock::time_point now = Clock::now ( ) ) -> long long
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds> ( deadline - now + std::chrono::milliseconds ( 1 ) - Clock::duration ( 1 ) ).count ( );
+}
+
+// Seconds added to the wall clock the core reads. The module leaves it at
+// 0; bench/timer_soak.cpp steps it to play clock jumps.
+inline auto wall_clock_offset ( ) -> std::atomic<long long>&
+{
+    static std::atomic<long long> offset { 0 };
+    return offset;
+}
+// The wall clock in Unix seconds, as the journal and cron schedules see it.
+inline auto wall_time ( ) -> long long
+{
+    return static_cast<long long> ( time ( 0 ) ) + wall_clock_offset ( ).load ( std::memory_order_relaxed );
+}
+// The same in Unix milliseconds, for the journal.
+inline auto wall_time_ms ( ) -> long long
+{
+    const auto since_epoch = std::chrono::system_clock::now ( ).time_since_epoch ( );
+    return std::chrono::duration_cast<std::chrono::milliseconds> ( since_epoch ).count ( ) +
+           wall_clock_offset ( ).load ( std::memory_order_relaxed ) * 1000;
+}
+
+// A timer is a trivially copyable value: the reason lives in an inline
+// buffer, so creating, moving and expiring timers never allocates.
+class Timer
+{
+public:
+    static constexpr size_t REASON_LENGTH_MAX{128u};
+    static constexpr size_t NETWORK_LENGTH_MAX{32u};
+    static constexpr size_t CHANNEL_LENGTH_MAX{64u};
+
+    Timer ( ) = default;
+    // A non-zero interval makes the timer fire again every interval
+    // after its first deadline. The reason is copied straight from the
+    // caller's buffer (usually the command line) and cut off at
+    // REASON_LENGTH_MAX.
+    Timer ( const char *reason, size_t length, Clock::duration duration, unsigned int id,
+            Clock::duration interval = Clock::duration::zero ( ) )
+    {
+        reset ( reason, length, duration, id, interval );
+    }
+    Timer ( const std::string &reason, Clock::duration duration, unsigned int id,
+            Clock::duration interval = Clock::duration::zero ( ) )
+        : Timer ( reason.data ( ), reason.size ( ), duration, id, interval ) { }
+    // Makes this the timer the constructor would have made, in place, so a
+    // timer can be built right where it is queued.
+    void reset ( const char *reason, size_t length, Clock::duration duration, unsigned int id,
+                 Clock::duration interval = Clock::duration::zero ( ) )
+    {
+        deadline_ = Clock::now ( ) + duration;
+        interval_ = interval;
+        cron_ = CronSchedule ( );
+        cron_deferred_ = false;
+        if ( length == 0 ) {
+            reason = "Default";
+            length = 7u;
+        }
+        reason_length_ = length < REASON_LENGTH_MAX ? length : REASON_LENGTH_MAX;
+        std::copy ( reason, reason + reason_length_, reason_ );
+        timer_id_ = id;
+        network_length_ = 0u;
+        channel_length_ = 0u;
+    }
+    auto get_deadline ( ) const -> Clock::time_point
+    {
+        return deadline_;
+    }
+    // Wall-clock end time as seen from the current wall clock.
+    auto get_end_time ( ) const -> long long
+    {
+        return wall_time ( ) + seconds_until ( deadline_ );
+    }
+    // The same in milliseconds, as the journal keeps it.
+    auto get_end_time_ms ( ) const -> long long
+    {
+        return wall_time_ms ( ) + milliseconds_until ( deadline_ );
+    }
+    auto get_interval ( ) const -> Clock::duration
+    {
+        return interval_;
+    }
+    auto get_cron ( ) const -> const CronSchedule&
+    {
+        return cron_;
+    }
+    void set_cron ( const CronSchedule &cron )
+    {
+        cron_ = cron;
+    }
+    // A deferred schedule isn't worked out when the timer fires; it waits
+    // a minute, the shortest a schedule repeats in, for its owner to
+    // reschedule it from a thread where libc's time zone code may run.
+    void set_cron_deferred ( bool deferred )
+    {
+        cron_deferred_ = deferred;
+    }
+    auto is_recurring ( ) const -> bool
+    {
+        return interval_ > Clock::duration::zero ( ) || cron_.valid ( );
+    }
+    // The first deadline of a recurring timer after now, skipping the ones
+    // that were missed, or NO_DEADLINE once a schedule never fires again.
+    auto next_deadline_after ( Clock::time_point now ) const -> Clock::time_point
+    {
+        if ( cron_.valid ( ) ) {
+            if ( cron_deferred_ ) return now + std::chrono::minutes ( 1 );
+            const auto wall_now = wall_time ( );
+            const auto next = cron_.next_fire ( static_cast<time_t> ( wall_now ) );
+            return next == 0 ? NO_DEADLINE : now + std::chrono::seconds ( next - wall_now );
+        }
+        return deadline_ + ( ( now - deadline_ ) / interval_ + 1 ) * interval_;
+    }
+    void set_deadline ( Clock::time_point deadline )
+    {
+        deadline_ = deadline;
+    }
+    auto timer_ran_out (  ) const -> bool
+    {
+        return Clock::now ( ) >= deadline_;
+    }
+    auto get_timer ( ) const -> std::string
+    {
+        return std::string ( reason_, reason_length_ );
+    }
+    auto get_reason ( ) const -> const char*
+    {
+        return reason_;
+    }
+    auto get_reason_length ( ) const -> size_t
+    {
+        return reason_length_;
+    }
+    auto get_id ( ) const -> unsigned
+    {
+        return timer_id_;
+    }
+    void set_id ( unsigned id )
+    {
+        timer_id_ = id;
+    }
+    auto get_remaining_time ( ) const -> std::string
+    {
+        return parser::string_from_secs(get_end_time ( ));
+    }
+    // A timer with a target is posted to that channel (or nick) on one of
+    // the user's networks instead of being sent to the user. Fails if
+    // either name does not fit.
+    static auto target_fits ( const std::string &network, const std::string &channel ) -> bool
+    {
+        return network.size ( ) <= NETWORK_LENGTH_MAX && channel.size ( ) <= CHANNEL_LENGTH_MAX;
+    }
+    auto set_target ( const std::string &network, const std::string &channel ) -> bool
+    {
+        if ( !target_fits ( network, channel ) ) return false;
+        network_length_ = network.copy ( network_, NETWORK_LENGTH_MAX );
+        channel_length_ = channel.copy ( channel_, CHANNEL_LENGTH_MAX );
+        return true;
+    }
+    auto has_target ( ) const -> bool
+    {
+        return network_length_ > 0;
+    }
+    auto get_network ( ) const -> std::string
+    {
+        return std::string ( network_, network_length_ );
+    }
+    auto get_channel ( ) const -> std::string
+    {
+        return std::string ( channel_, channel_length_ );
+    }
+    // Like get_network and get_channel, without the copy.
+    auto get_network_data ( ) const -> const char*
+    {
+        return network_;
+    }
+    auto get_network_length ( ) const -> size_t
+    {
+        return network_length_;
+    }
+    auto get_channel_data ( ) const -> const char*
+    {
+        return channel_;
+    }
+    auto get_channel_length ( ) const -> size_t
+    {
+        return channel_length_;
+    }
+private:
+    Clock::time_point deadline_;
+    Clock::duration interval_ = Clock::duration::zero ( );
+    CronSchedule cron_;
+    bool cron_deferred_ = false;
+    unsigned timer_id_ = 0u;
+    size_t reason_length_ = 0u;
+    char reason_[ REASON_LENGTH_MAX ];
+    size_t network_length_ = 0u;
+    size_t channel_length_ = 0u;
+    char network_[ NETWORK_LENGTH_MAX ];
+    char channel_[ CHANNEL_LENGTH_MAX ];
+};
+
+// Open-addressing map from timer id to pool slot. Ids are never 0, which
+// marks an empty bucket. Deletion shifts the following cluster back, so
+// lookups never need tombstones and nothing is allocated until the table
+// has to grow.
+class TimerIndex
+{
+public:
+    auto find ( unsigned id ) const -> const uint32_t*
+    {
+        if ( buckets_.empty ( ) ) return nullptr;
+        for ( auto pos = home ( id ); buckets_[ pos ].id != 0; pos = next ( pos ) )
+            if ( buckets_[ pos ].id == id ) return &buckets_[ pos ].slot;
+        return nullptr;
+    }
+    void insert ( unsigned id, uint32_t slot )
+    {
+        if ( ( size_ + 1 ) * 2 > buckets_.size ( ) ) grow ( );
+        auto pos = home ( id );
+        while ( buckets_[ pos ].id != 0 ) pos = next ( pos );
+        buckets_[ pos ] = Bucket { id, slot };
+        ++size_;
+    }
+    void erase ( unsigned id )
+    {
+        if ( buckets_.empty ( ) ) return;
+        auto pos = home ( id );
+        while ( buckets_[ pos ].id != id ) {
+            if ( buckets_[ pos ].id == 0 ) return;
+            pos = next ( pos );
+        }
+        // Backward-shift every following entry that would otherwise
+        // become unreachable from its home bucket.
+        for ( auto hole = pos, cur = next ( pos ); ; cur = next ( cur ) ) {
+            if ( buckets_[ cur ].id == 0 ) {
+                buckets_[ hole ].id = 0;
+                break;
+            }
+            const auto want = home ( buckets_[ cur ].id );
+            if ( ( ( cur - want ) & mask ( ) ) >= ( ( cur - hole ) & mask ( ) ) ) {
+                buckets_[ hole ] = buckets_[ cur ];
+                hole = cur;
+            }
+        }
+        --size_;
+    }
+
+private:
+    struct Bucket
+    {
+        unsigned id;
+        uint32_t slot;
+    };
+
+    auto mask ( ) const -> size_t
+    {
+        return buckets_.size ( ) - 1;
+    }
+    auto home ( unsigned id ) const -> size_t
+    {
+        return ( id * 2654435761u ) & mask ( );
+    }
+    auto next ( size_t pos ) const -> size_t
+    {
+        return ( pos + 1 ) & mask ( );
+    }
+    void grow ( )
+    {
+        std::vector<Bucket> old ( std::max<size_t> ( 16u, buckets_.size ( ) * 2 ), Bucket { 0u, 0u } );
+        old.swap ( buckets_ );
+        size_ = 0;
+        for ( const auto &b : old )
+            if ( b.id != 0 ) insert ( b.id, b.slot );
+    }
+
+    std::vector<Bucket> buckets_;
+    size_t size_ = 0u;
+};
+
+// 4-ary min-heap of timers ordered by deadline (ties by id, so timers
+// with the same deadline fire in the order they were added).
+//
+// The storage is split by temperature. The heap is a contiguous array of
+// 16 byte keys (deadline, id, slot), so sifting compares keys without
+// ever touching a Timer and a cache line holds four of them. The Timers
+// themselves, reason text included, live in a slab (pool_) whose slots
+// are recycled through a free list and are only read when one is
+// delivered, listed or journaled. pos_ tracks where each slot's key
+// sits, so a timer can be moved to a new deadline in place. Together
+// with TimerIndex this makes insert, pop-min and rescheduling O(log n)
+// and keeps them off malloc once the pool has grown to the working-set
+// size.
+//
+// Cancelling is O(1): the timer leaves the index and its slot is flagged
+// in dead_, while its key stays in the heap until it reaches the top
+// (where it is dropped) or until such tombstones make up half the heap,
+// which rebuilds it in O(n). The top is never a tombstone.
+class TimerQueue
+{
+public:
+    auto empty ( ) const -> bool
+    {
+        return heap_.empty ( );
+    }
+    auto size ( ) const -> size_t
+    {
+        return heap_.size ( ) - cancelled_;
+    }
+    auto top ( ) const -> const Timer&
+    {
+        return pool_[ heap_.front ( ).slot ];
+    }
+    auto next_deadline ( ) const -> Clock::time_point
+    {
+        return heap_.empty ( ) ? NO_DEADLINE : top ( ).get_deadline ( );
+    }
+    // Appends up to limit timers whose deadline is at most now to due, as
+    // they were when they fired, and returns how many. Recurring timers
+    // are moved to their next deadline, the others are removed.
+    auto pop_due ( Clock::time_point now, size_t limit, std::vector<Timer> &due ) -> size_t
+    {
+        size_t fired = 0u;
+        for ( ; fired < limit && !heap_.empty ( ) && top ( ).get_deadline ( ) <= now; ++fired ) {
+            due.push_back ( top ( ) );
+            const auto next = top ( ).is_recurring ( ) ? top ( ).next_deadline_after ( now ) : NO_DEADLINE;
+            if ( next != NO_DEADLINE )
+                reschedule_top ( next );
+            else
+                pop ( );
+        }
+        return fired;
+    }
+    void reserve ( size_t count )
+    {
+        pool_.reserve ( count );
+        dead_.reserve ( count );
+        pos_.reserve ( count );
+        heap_.reserve ( count );
+        free_.reserve ( count );
+    }
+    // Replaces the contents with timers in O(n), for reloading.
+    void assign ( const std::vector<Timer> &timers )
+    {
+        pool_.clear ( );
+        dead_.clear ( );
+        pos_.clear ( );
+        free_.clear ( );
+        heap_.clear ( );
+        index_ = TimerIndex ( );
+        cancelled_ = 0u;
+        ++version_;
+        reserve ( timers.size ( ) );
+        for ( const auto &timer : timers ) {
+            const auto slot = static_cast<uint32_t> ( pool_.size ( ) );
+            pool_.push_back ( timer );
+            dead_.push_back ( false );
+            pos_.push_back ( 0u );
+            index_.insert ( timer.get_id ( ), slot );
+            heap_.push_back ( key ( timer, slot ) );
+        }
+        heapify ( );
+    }
+    // Visits every timer in heap order, which is not firing order.
+    template <typename Visit>
+    void for_each ( Visit visit ) const
+    {
+        for ( const auto &k : heap_ )
+            if ( !dead_[ k.slot ] ) visit ( pool_[ k.slot ] );
+    }
+    void push ( const Timer &timer )
+    {
+        uint32_t slot;
+        if ( !free_.empty ( ) ) {
+            slot = free_.back ( );
+            free_.pop_back ( );
+            pool_[ slot ] = timer;
+        } else {
+            slot = static_cast<uint32_t> ( pool_.size ( ) );
+            pool_.push_back ( timer );
+            dead_.push_back ( false );
+            pos_.push_back ( 0u );
+        }
+        index_.insert ( timer.get_id ( ), slot );
+        heap_.push_back ( key ( timer, slot ) );
+        sift_up ( heap_.size ( ) - 1 );
+        ++version_;
+    }
+    void pop ( )
+    {
+        remove_top ( );
+        drop_cancelled ( );
+    }
+    // Moves the earliest timer to a later deadline in place: its slot and
+    // reason are kept and only its key moves down the heap.
+    void reschedule_top ( Clock::time_point deadline )
+    {
+        pool_[ heap_.front ( ).slot ].set_deadline ( deadline );
+        heap_.front ( ).deadline = deadline.time_since_epoch ( ).count ( );
+        sift_down ( 0 );
+        ++version_;
+        drop_cancelled ( );
+    }
+    auto find ( unsigned id ) const -> const Timer*
+    {
+        const auto slot = index_.find ( id );
+        return slot ? &pool_[ *slot ] : nullptr;
+    }
+    // Moves any timer to an earlier or later deadline in place, keeping
+    // its id and slot: a decrease- or increase-key on its heap entry.
+    auto reschedule ( unsigned id, Clock::time_point deadline ) -> bool
+    {
+        const auto found = index_.find ( id );
+        if ( !found ) return false;
+        const auto slot = *found;
+        pool_[ slot ].set_deadline ( deadline );
+        heap_[ pos_[ slot ] ].deadline = deadline.time_since_epoch ( ).count ( );
+        sift_up ( pos_[ slot ] );
+        sift_down ( pos_[ slot ] );
+        ++version_;
+        // A later deadline can leave a tombstone on top.
+        drop_cancelled ( );
+        return true;
+    }
+    auto remove ( unsigned id ) -> bool
+    {
+        const auto found = index_.find ( id );
+        if ( !found ) return false;
+        const auto slot = *found;
+        index_.erase ( id );
+        dead_[ slot ] = true;
+        ++cancelled_;
+        ++version_;
+        drop_cancelled ( );
+        return true;
+    }
+    // Copy of the queue in firing order, for listing.
+    auto sorted ( ) const -> std::vector<Timer>
+    {
+        std::vector<Key> keys;
+        keys.reserve ( size ( ) );
+        for ( const auto &k : heap_ )
+            if ( !dead_[ k.slot ] ) keys.push_back ( k );
+        std::sort ( keys.begin ( ), keys.end ( ), before );
+        std::vector<Timer> timers;
+        timers.reserve ( keys.size ( ) );
+        for ( const auto &k : keys ) timers.push_back ( pool_[ k.slot ] );
+        return timers;
+    }
+    // Bumped by every change, so copies made by sorted() can be reused
+    // until the queue changes.
+    auto version ( ) const -> unsigned long long
+    {
+        return version_;
+    }
+
+private:
+    static constexpr size_t ARITY = 4u;
+    // Below this many tombstones the heap is never rebuilt.
+    static constexpr size_t COMPACT_MIN = 64u;
+
+    struct Key
+    {
+        Clock::rep deadline;
+        unsigned id;
+        uint32_t slot;
+    };
+
+    static auto key ( const Timer &timer, uint32_t slot ) -> Key
+    {
+        return Key { timer.get_deadline ( ).time_since_epoch ( ).count ( ), timer.get_id ( ), slot };
+    }
+    static auto before ( const Key &a, const Key &b ) -> bool
+    {
+        if ( a.deadline != b.deadline ) return a.deadline < b.deadline;
+        return a.id < b.id;
+    }
+    void remove_top ( )
+    {
+        const auto slot = heap_.front ( ).slot;
+        if ( dead_[ slot ] ) {
+            dead_[ slot ] = false;
+            --cancelled_;
+        } else {
+            index_.erase ( heap_.front ( ).id );
+        }
+        free_.push_back ( slot );
+        ++version_;
+        place ( 0, heap_.back ( ) );
+        heap_.pop_back ( );
+        if ( !heap_.empty ( ) ) sift_down ( 0 );
+    }
+    // Restores the invariant that the top is live, and rebuilds the heap
+    // without its tombstones once they are half of it.
+    void drop_cancelled ( )
+    {
+        while ( !heap_.empty ( ) && dead_[ heap_.front ( ).slot ] ) remove_top ( );
+        if ( cancelled_ < COMPACT_MIN || cancelled_ * 2 < heap_.size ( ) ) return;
+        size_t live = 0u;
+        for ( const auto &k : heap_ ) {
+            if ( dead_[ k.slot ] ) {
+                dead_[ k.slot ] = false;
+                free_.push_back ( k.slot );
+            } else {
+                heap_[ live++ ] = k;
+            }
+        }
+        heap_.resize ( live );
+        cancelled_ = 0u;
+        heapify ( );
+    }
+    void heapify ( )
+    {
+        for ( size_t pos = 0; pos < heap_.size ( ); ++pos ) pos_[ heap_[ pos ].slot ] = static_cast<uint32_t> ( pos );
+        for ( auto pos = heap_.size ( ) / ARITY + 1; pos-- > 0; )
+            if ( pos < heap_.size ( ) ) sift_down ( pos );
+    }
+    void place ( size_t pos, const Key &k )
+    {
+        heap_[ pos ] = k;
+        pos_[ k.slot ] = static_cast<uint32_t> ( pos );
+    }
+    void sift_up ( size_t pos )
+    {
+        const auto k = heap_[ pos ];
+        while ( pos > 0 ) {
+            const auto parent = ( pos - 1 ) / ARITY;
+            if ( !before ( k, heap_[ parent ] ) ) break;
+            place ( pos, heap_[ parent ] );
+            pos = parent;
+        }
+        place ( pos, k );
+    }
+    void sift_down ( size_t pos )
+    {
+        const auto k = heap_[ pos ];
+        for ( ;; ) {
+            const auto first = pos * ARITY + 1;
+            if ( first >= heap_.size ( ) ) break;
+            auto best = first;
+            const auto end = std::min ( first + ARITY, heap_.size ( ) );
+            for ( auto child = first + 1; child < end; ++child )
+                if ( before ( heap_[ child ], heap_[ best ] ) ) best = child;
+            if ( !before ( heap_[ best ], k ) ) break;
+            place ( pos, heap_[ best ] );
+            pos = best;
+        }
+        place ( pos, k );
+    }
+
+    std::vector<Timer> pool_;
+    std::vector<bool> dead_;
+    std::vector<uint32_t> pos_;
+    std::vector<uint32_t> free_;
+    std::vector<Key> heap_;
+    TimerIndex index_;
+    size_t cancelled_ = 0u;
+    unsigned long long version_ = 0u;
+};
+
+// Hierarchical timing wheel over 1ms ticks, with one tier each for the
+// milliseconds, seconds, minutes, hours and days of a deadline. A timer
+// goes into the coarsest tier whose digit of its tick differs from the
+// current tick's and is only cascaded into a finer tier once its slot
+// comes up. So a 999 day timer costs the same as a 5 second one: insert,
+// cancel and expiry are O(1), and getting to the next occupied slot is a
+// scan of a few bitmap words, no matter how many timers there are. Ticks
+// are rounded up, so nothing fires early and at most 1ms late.
+//
+// Slots are intrusive doubly linked lists through the same kind of slab
+// and index as TimerQueue uses. Timers whose tick has been reached wait in
+// the due list until pop_due hands them out.
+class TimingWheel
+{
+public:
+    TimingWheel ( ) : base_ ( Clock::now ( ) )
+    {
+        heads_.assign ( BUCKETS, uint32_t ( NIL ) );
+    }
+    auto empty ( ) const -> bool
+    {
+        return size_ == 0;
+    }
+    auto size ( ) const -> size_t
+    {
+        return size_;
+    }
+    // When the earliest timer is due or, when the next occupied slot is in
+    // a coarser tier, when that slot has to be cascaded. Nothing may be due
+    // by then.
+    auto next_deadline ( ) const -> Clock::time_point
+    {
+        if ( heads_[ DUE ] != NIL ) return base_ + std::chrono::milliseconds ( cursor_ );
+        const auto event = next_event ( );
+        return event == NO_EVENT ? NO_DEADLINE : base_ + std::chrono::milliseconds ( event );
+    }
+    // Same contract as TimerQueue::pop_due, though timers that are due at
+    // the same time are handed out in no particular order.
+    auto pop_due ( Clock::time_point now, size_t limit, std::vector<Timer> &due ) -> size_t
+    {
+        advance ( std::chrono::duration_cast<std::chrono::milliseconds> ( now - base_ ).count ( ) );
+        size_t fired = 0u;
+        for ( ; fired < limit && heads_[ DUE ] != NIL; ++fired ) {
+            const auto slot = heads_[ DUE ];
+            auto &timer = pool_[ slot ];
+            due.push_back ( timer );
+            unlink ( slot );
+            const auto next = timer.is_recurring ( ) ? timer.next_deadline_after ( now ) : NO_DEADLINE;
+            if ( next != NO_DEADLINE ) {
+                timer.set_deadline ( next );
+                place ( slot );
+            } else {
+                release ( slot );
+            }
+        }
+        if ( fired > 0 ) ++version_;
+        return fired;
+    }
+    void reserve ( size_t count )
+    {
+        pool_.reserve ( count );
+        next_.reserve ( count );
+        prev_.reserve ( count );
+        bucket_.reserve ( count );
+        free_.reserve ( count );
+    }
+    void assign ( const std::vector<Timer> &timers )
+    {
+        *this = TimingWheel ( );
+        reserve ( timers.size ( ) );
+        for ( const auto &timer : timers ) push ( timer );
+    }
+    // Visits every timer in slab order, which is not firing order.
+    template <typename Visit>
+    void for_each ( Visit visit ) const
+    {
+        for ( size_t slot = 0; slot < pool_.size ( ); ++slot )
+            if ( bucket_[ slot ] != FREE ) visit ( pool_[ slot ] );
+    }
+    void push ( const Timer &timer )
+    {
+        uint32_t slot;
+        if ( !free_.empty ( ) ) {
+            slot = free_.back ( );
+            free_.pop_back ( );
+            pool_[ slot ] = timer;
+        } else {
+            slot = static_cast<uint32_t> ( pool_.size ( ) );
+            pool_.push_back ( timer );
+            // Copied, push_back would bind the constants to a reference.
+            next_.push_back ( uint32_t ( NIL ) );
+            prev_.push_back ( uint32_t ( NIL ) );
+            bucket_.push_back ( uint16_t ( FREE ) );
+        }
+        index_.insert ( timer.get_id ( ), slot );
+        place ( slot );
+        ++size_;
+        ++version_;
+    }
+    auto find ( unsigned id ) const -> const Timer*
+    {
+        const auto slot = index_.find ( id );
+        return slot ? &pool_[ *slot ] : nullptr;
+    }
+    auto reschedule ( unsigned id, Clock::time_point deadline ) -> bool
+    {
+        const auto found = index_.find ( id );
+        if ( !found ) return false;
+        const auto slot = *found;
+        unlink ( slot );
+        pool_[ slot ].set_deadline ( deadline );
+        place ( slot );
+        ++version_;
+        return true;
+    }
+    auto remove ( unsigned id ) -> bool
+    {
+        const auto found = index_.find ( id );
+        if ( !found ) return false;
+        const auto slot = *found;
+        unlink ( slot );
+        release ( slot );
+        ++version_;
+        return true;
+    }
+    // Copy of the timers in firing order, for listing.
+    auto sorted ( ) const -> std::vector<Timer>
+    {
+        std::vector<uint32_t> slots;
+        slots.reserve ( size_ );
+        for ( uint32_t slot = 0; slot < pool_.size ( ); ++slot )
+            if ( bucket_[ slot ] != FREE ) slots.push_back ( slot );
+        std::sort ( slots.begin ( ), slots.end ( ), [ this ] ( uint32_t a, uint32_t b ) {
+            const auto &x = pool_[ a ], &y = pool_[ b ];
+            if ( x.get_deadline ( ) != y.get_deadline ( ) ) return x.get_deadline ( ) < y.get_deadline ( );
+            return x.get_id ( ) < y.get_id ( );
+        } );
+        std::vector<Timer> timers;
+        timers.reserve ( slots.size ( ) );
+        for ( const auto slot : slots ) timers.push_back ( pool_[ slot ] );
+        return timers;
+    }
+    auto version ( ) const -> unsigned long long
+    {
+        return version_;
+    }
+
+private:
+    static constexpr size_t TIERS = 5u;
+    // Slots per tier, the ticks one slot spans (ms, s, min, h and days) and
+    // where the tier's slots start in heads_. The day tier wraps around; a
+    // timer further out than it reaches waits in its last slot and is
+    // placed again from there.
+    static constexpr auto radix ( size_t tier ) -> long long
+    {
+        return tier == 0 ? 1000 : tier < 3 ? 60 : tier == 3 ? 24 : 1024;
+    }
+    static constexpr auto span ( size_t tier ) -> long long
+    {
+        return tier == 0 ? 1 : tier == 1 ? 1000 : tier == 2 ? 60000 : tier == 3 ? 3600000 : 86400000;
+    }
+    static constexpr auto offset ( size_t tier ) -> size_t
+    {
+        return tier == 0 ? 0u : tier == 1 ? 1000u : tier == 2 ? 1060u : tier == 3 ? 1120u : 1144u;
+    }
+    static constexpr size_t DUE = 2168u;
+    static constexpr size_t BUCKETS = DUE + 1;
+    static constexpr uint32_t NIL = 0xffffffffu;
+    static constexpr uint16_t FREE = 0xffffu;
+    static constexpr long long NO_EVENT = 0x7fffffffffffffffLL;
+
+    // First tick at or after deadline.
+    auto tick_of ( Clock::time_point deadline ) const -> long long
+    {
+        const auto since = deadline - base_;
+        auto tick = std::chrono::duration_cast<std::chrono::milliseconds> ( since ).count ( );
+        if ( std::chrono::milliseconds ( tick ) < since ) ++tick;
+        return tick;
+    }
+    void place ( uint32_t slot )
+    {
+        const auto tick = tick_of ( pool_[ slot ].get_deadline ( ) );
+        if ( tick <= cursor_ ) {
+            link_due ( slot );
+            return;
+        }
+        size_t tier = TIERS - 1;
+        while ( tier > 0 && tick / span ( tier ) == cursor_ / span ( tier ) ) --tier;
+        auto digit = tick / span ( tier );
+        if ( tier == TIERS - 1 && digit - cursor_ / span ( tier ) >= radix ( tier ) )
+            digit = cursor_ / span ( tier ) + radix ( tier ) - 1;
+        link ( slot, offset ( tier ) + static_cast<size_t> ( digit % radix ( tier ) ) );
+    }
+    void link ( uint32_t slot, size_t bucket )
+    {
+        bucket_[ slot ] = static_cast<uint16_t> ( bucket );
+        prev_[ slot ] = NIL;
+        next_[ slot ] = heads_[ bucket ];
+        if ( heads_[ bucket ] != NIL ) prev_[ heads_[ bucket ] ] = slot;
+        heads_[ bucket ] = slot;
+        occupied_[ bucket / 64 ] |= 1ULL << ( bucket % 64 );
+    }
+    // The due list keeps the order timers became due in.
+    void link_due ( uint32_t slot )
+    {
+        bucket_[ slot ] = static_cast<uint16_t> ( DUE );
+        next_[ slot ] = NIL;
+        prev_[ slot ] = due_tail_;
+        if ( due_tail_ != NIL )
+            next_[ due_tail_ ] = slot;
+        else
+            heads_[ DUE ] = slot;
+        due_tail_ = slot;
+    }
+    void unlink ( uint32_t slot )
+    {
+        const size_t bucket = bucket_[ slot ];
+        if ( prev_[ slot ] != NIL )
+            next_[ prev_[ slot ] ] = next_[ slot ];
+        else
+            heads_[ bucket ] = next_[ slot ];
+        if ( next_[ slot ] != NIL )
+            prev_[ next_[ slot ] ] = prev_[ slot ];
+        else if ( bucket == DUE )
+            due_tail_ = prev_[ slot ];
+        if ( bucket != DUE && heads_[ bucket ] == NIL ) occupied_[ bucket / 64 ] &= ~( 1ULL << ( bucket % 64 ) );
+    }
+    void release ( uint32_t slot )
+    {
+        index_.erase ( pool_[ slot ].get_id ( ) );
+        bucket_[ slot ] = FREE;
+        free_.push_back ( slot );
+        --size_;
+    }
+    // Places every timer of bucket again, relative to the current tick.
+    void cascade ( size_t bucket )
+    {
+        auto slot = heads_[ bucket ];
+        heads_[ bucket ] = NIL;
+        occupied_[ bucket / 64 ] &= ~( 1ULL << ( bucket % 64 ) );
+        while ( slot != NIL ) {
+            const auto next = next_[ slot ];
+            place ( slot );
+            slot = next;
+        }
+    }
+    // First occupied bucket in [ from, to ), or to.
+    auto next_occupied ( size_t from, size_t to ) const -> size_t
+    {
+        while ( from < to ) {
+            const auto bits = occupied_[ from / 64 ] >> ( from % 64 );
+            if ( bits != 0 ) {
+                const auto found = from + static_cast<size_t> ( __builtin_ctzll ( bits ) );
+                return found < to ? found : to;
+            }
+            from = ( from / 64 + 1 ) * 64;
+        }
+        return to;
+    }
+    // The next tick after the current one at which a slot fires or has to
+    // be cascaded. A tier's occupied slots all come before the finer tier
+    // wraps around, so the finest tier with any is the one that decides.
+    auto next_event ( ) const -> long long
+    {
+        for ( size_t tier = 0; tier < TIERS - 1; ++tier ) {
+            const auto digit = static_cast<size_t> ( cursor_ / span ( tier ) % radix ( tier ) );
+            const auto end = offset ( tier ) + static_cast<size_t> ( radix ( tier ) );
+            const auto found = next_occupied ( offset ( tier ) + digit + 1, end );
+            if ( found != end )
+                return cursor_ / span ( tier + 1 ) * span ( tier + 1 ) + static_cast<long long> ( found - offset ( tier ) ) * span ( tier );
+        }
+        const auto tier = TIERS - 1;
+        const auto day = cursor_ / span ( tier );
+        const auto digit = static_cast<size_t> ( day % radix ( tier ) );
+        const auto end = offset ( tier ) + static_cast<size_t> ( radix ( tier ) );
+        auto found = next_occupied ( offset ( tier ) + digit + 1, end );
+        if ( found == end ) found = next_occupied ( offset ( tier ), offset ( tier ) + digit );
+        if ( found == end || found == offset ( tier ) + digit ) return NO_EVENT;
+        const auto ahead = ( static_cast<long long> ( found - offset ( tier ) ) - static_cast<long long> ( digit ) + radix ( tier ) ) % radix ( tier );
+        return ( day + ahead ) * span ( tier );
+    }
+    // Processes every tick up to target that has anything to do, moving
+    // what became due to the due list.
+    void advance ( long long target )
+    {
+        while ( cursor_ < target ) {
+            const auto event = next_event ( );
+            if ( event > target ) {
+                cursor_ = target;
+                return;
+            }
+            cursor_ = event;
+            for ( auto tier = TIERS - 1; tier > 0; --tier )
+                if ( event % span ( tier ) == 0 ) cascade ( offset ( tier ) + static_cast<size_t> ( event / span ( tier ) % radix ( tier ) ) );
+            const auto bucket = static_cast<size_t> ( event % radix ( 0 ) );
+            for ( auto slot = heads_[ bucket ]; slot != NIL; ) {
+                const auto next = next_[ slot ];
+                link_due ( slot );
+                slot = next;
+            }
+            heads_[ bucket ] = NIL;
+            occupied_[ bucket / 64 ] &= ~( 1ULL << ( bucket % 64 ) );
+        }
+    }
+
+    std::vector<Timer> pool_;
+    std::vector<uint32_t> next_;
+    std::vector<uint32_t> prev_;
+    std::vector<uint16_t> bucket_;
+    std::vector<uint32_t> free_;
+    std::vector<uint32_t> heads_;
+    uint64_t occupied_[ ( DUE + 63 ) / 64 ] = { };
+    uint32_t due_tail_ = NIL;
+    TimerIndex index_;
+    // Tick 0; every tick up to cursor_ has been processed.
+    Clock::time_point base_;
+    long long cursor_ = 0;
+    size_t size_ = 0u;
+    unsigned long long version_ = 0u;
+};
+
+// What CAlarm needs from a timer queue, so that the heap and the wheel
+// can be picked per module (the engine= load argument) and benchmarked
+// against each other.
+class TimerEngine
+{
+public:
+    virtual ~TimerEngine ( ) = default;
+    virtual auto size ( ) const -> size_t = 0;
+    virtual auto next_deadline ( ) const -> Clock::time_point = 0;
+    virtual auto pop_due ( Clock::time_point now, size_t limit, std::vector<Timer> &due ) -> size_t = 0;
+    virtual void assign ( const std::vector<Timer> &timers ) = 0;
+    virtual void push ( const Timer &timer ) = 0;
+    virtual auto find ( unsigned id ) const -> const Timer* = 0;
+    virtual auto reschedule ( unsigned id, Clock::time_point deadline ) -> bool = 0;
+    virtual auto remove ( unsigned id ) -> bool = 0;
+    virtual void for_each ( const std::function<void ( const Timer& )> &visit ) const = 0;
+    virtual auto sorted ( ) const -> std::vector<Timer> = 0;
+    virtual auto version ( ) const -> unsigned long long = 0;
+};
+
+template <typename Queue>
+class QueueEngine final : public TimerEngine
+{
+public:
+    auto size ( ) const -> size_t override
+    {
+        return queue_.size ( );
+    }
+    auto next_deadline ( ) const -> Clock::time_point override
+    {
+        return queue_.next_deadline ( );
+    }
+    auto pop_due ( Clock::time_point now, size_t limit, std::vector<Timer> &due ) -> size_t override
+    {
+        return queue_.pop_due ( now, limit, due );
+    }
+    void assign ( const std::vector<Timer> &timers ) override
+    {
+        queue_.assign ( timers );
+    }
+    void push ( const Timer &timer ) override
+    {
+        queue_.push ( timer );
+    }
+    auto find ( unsigned id ) const -> const Timer* override
+    {
+        return queue_.find ( id );
+    }
+    auto reschedule ( unsigned id, Clock::time_point deadline ) -> bool override
+    {
+        return queue_.reschedule ( id, deadline );
+    }
+    auto remove ( unsigned id ) -> bool override
+    {
+        return queue_.remove ( id );
+    }
+    void for_each ( const std::function<void ( const Timer& )> &visit ) const override
+    {
+        queue_.for_each ( visit );
+    }
+    auto sorted ( ) const -> std::vector<Timer> override
+    {
+        return queue_.sorted ( );
+    }
+    auto version ( ) const -> unsigned long long override
+    {
+        return queue_.version ( );
+    }
+
+private:
+    Queue queue_;
+};
+
+// "heap" or "wheel", nullptr for anything else.
+inline auto make_timer_engine ( const std::string &name ) -> std::unique_ptr<TimerEngine>
+{
+    if ( name == "heap" ) return std::unique_ptr<TimerEngine> ( new QueueEngine<TimerQueue> ( ) );
+    if ( name == "wheel" ) return std::unique_ptr<TimerEngine> ( new QueueEngine<TimingWheel> ( ) );
+    return nullptr;
+}
+
+// Reasons of expired timers packed back to back into one buffer, so that
+// collecting a burst of them only allocates when the buffer has to grow.
+class ReasonList
+{
+public:
+    auto empty ( ) const -> bool
+    {
+        return spans_.empty ( );
+    }
+    auto size ( ) const -> size_t
+    {
+        return spans_.size ( );
+    }
+    auto data ( size_t index ) const -> const char*
+    {
+        return text_.data ( ) + spans_[ index ].offset;
+    }
+    auto length ( size_t index ) const -> size_t
+    {
+        return spans_[ index ].length;
+    }
+    void append ( const char *reason, size_t length )
+    {
+        spans_.push_back ( Span { text_.size ( ), length } );
+        text_.append ( reason, length );
+    }
+    // Forgets the first count reasons, keeping the capacity.
+    void drop_front ( size_t count )
+    {
+        if ( count >= spans_.size ( ) ) {
+            clear ( );
+            return;
+        }
+        const auto offset = spans_[ count ].offset;
+        text_.erase ( 0, offset );
+        spans_.erase ( spans_.begin ( ), spans_.begin ( ) + count );
+        for ( auto &span : spans_ ) span.offset -= offset;
+    }
+    void clear ( )
+    {
+        text_.clear ( );
+        spans_.clear ( );
+    }
+    void swap ( ReasonList &other )
+    {
+        text_.swap ( other.text_ );
+        spans_.swap ( other.spans_ );
+    }
+
+private:
+    struct Span
+    {
+        size_t offset;
+        size_t length;
+    };
+
+    std::string text_;
+    std::vector<Span> spans_;
+};
+
+// Log2 histogram of how late timers fired: bucket 0 counts deliveries
+// within 1us of the deadline, bucket i those up to 2^i us late.
+class LatencyHistogram
+{
+public:
+    static constexpr size_t BUCKETS = 36u;
+
+    void record ( Clock::duration lateness )
+    {
+        const auto us = std::max<long long> ( 0, std::chrono::duration_cast<std::chrono::microseconds> ( lateness ).count ( ) );
+        size_t bucket = 0u;
+        while ( bucket + 1 < BUCKETS && ( 1LL << bucket ) < us ) ++bucket;
+        ++buckets_[ bucket ];
+        ++count_;
+        max_us_ = std::max ( max_us_, us );
+    }
+    auto count ( ) const -> unsigned long long
+    {
+        return count_;
+    }
+    auto max_us ( ) const -> long long
+    {
+        return max_us_;
+    }
+    // Upper bound of the bucket holding the given percentile, in us.
+    auto percentile_us ( double percentile ) const -> long long
+    {
+        if ( count_ == 0 ) return 0;
+        const auto rank = static_cast<unsigned long long> ( percentile / 100.0 * ( count_ - 1 ) ) + 1;
+        unsigned long long seen = 0u;
+        for ( size_t bucket = 0; bucket < BUCKETS; ++bucket ) {
+            seen += buckets_[ bucket ];
+            if ( seen >= rank ) return std::min ( 1LL << bucket, max_us_ );
+        }
+        return max_us_;
+    }
+    auto bucket ( size_t index ) const -> unsigned long long
+    {
+        return buckets_[ index ];
+    }
+
+private:
+    unsigned long long buckets_[ BUCKETS ] = { };
+    unsigned long long count_ = 0u;
+    long long max_us_ = 0LL;
+};
+
+// Count, total and worst case of something that gets timed. Everything is
+// a relaxed atomic, so any thread may record without taking a lock and
+// readers just see slightly stale numbers.
+class DurationStat
+{
+public:
+    void record ( Clock::duration elapsed )
+    {
+        const auto ns = static_cast<unsigned long long> (
+            std::max<long long> ( 0, std::chrono::duration_cast<std::chrono::nanoseconds> ( elapsed ).count ( ) ) );
+        count_.fetch_add ( 1u, std::memory_order_relaxed );
+        total_ns_.fetch_add ( ns, std::memory_order_relaxed );
+        auto worst = max_ns_.load ( std::memory_order_relaxed );
+        while ( ns > worst && !max_ns_.compare_exchange_weak ( worst, ns, std::memory_order_relaxed ) ) { }
+    }
+    auto count ( ) const -> unsigned long long
+    {
+        return count_.load ( std::memory_order_relaxed );
+    }
+    auto mean_us ( ) const -> double
+    {
+        const auto n = count ( );
+        return n == 0 ? 0.0 : total_ns_.load ( std::memory_order_relaxed ) / 1000.0 / n;
+    }
+    auto max_us ( ) const -> double
+    {
+        return max_ns_.load ( std::memory_order_relaxed ) / 1000.0;
+    }
+
+private:
+    std::atomic<unsigned long long> count_ { 0u };
+    std::atomic<unsigned long long> total_ns_ { 0u };
+    std::atomic<unsigned long long> max_ns_ { 0u };
+};
+
+// Multi-producer, single-consumer queue after Dmitry Vyukov's design:
+// push is wait-free and takes no lock, pop may only be called by one
+// thread at a time. A pop can briefly miss a push that is still in
+// flight; callers have to re-check after the producer signals them.
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue ( ) : head_ ( new Node ( ) ), tail_ ( head_.load ( ) ) { }
+    MpscQueue ( const MpscQueue& ) = delete;
+    auto operator= ( const MpscQueue& ) -> MpscQueue& = delete;
+    ~MpscQueue ( )
+    {
+        T value;
+        while ( pop ( value ) ) { }
+        delete tail_;
+    }
+    void push ( T value )
+    {
+        emplace ( [ &value ] ( T &slot ) {
+            slot = std::move ( value );
+        } );
+    }
+    // Like push, but fill ( T& ) writes the value straight into its node.
+    template <typename Fill>
+    void emplace ( Fill fill )
+    {
+        auto *node = new Node ( );
+        fill ( node->value );
+        head_.exchange ( node, std::memory_order_acq_rel )->next.store ( node, std::memory_order_release );
+    }
+    auto pop ( T &value ) -> bool
+    {
+        return consume ( [ &value ] ( T &front ) {
+            value = std::move ( front );
+        } );
+    }
+    // Like pop, but hands visit ( T& ) the value where it is, in its node.
+    template <typename Visit>
+    auto consume ( Visit visit ) -> bool
+    {
+        auto *next = tail_->next.load ( std::memory_order_acquire );
+        if ( !next ) return false;
+        visit ( next->value );
+        delete tail_;
+        tail_ = next;
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node*> next { nullptr };
+        T value;
+    };
+
+    std::atomic<Node*> head_;
+    Node *tail_;
+};
+
+// Formatted wall-clock expiry times of listed timers, by timer id. Each
+// one is only formatted again once the end time it shows has changed, as
+// formatting in a user's time zone is a lot dearer than looking it up.
+class ExpiryTextCache
+{
+public:
+    // format ( end_time ) must return the text to show for end_time.
+    template <typename Format>
+    auto get ( unsigned id, long long end_time, Format format ) -> const std::string&
+    {
+        auto &entry = entries_[ id ];
+        if ( entry.end_time != end_time ) {
+            entry.end_time = end_time;
+            entry.text = format ( end_time );
+        }
+        return entry.text;
+    }
+    auto size ( ) const -> size_t
+    {
+        return entries_.size ( );
+    }
+    void clear ( )
+    {
+        entries_.clear ( );
+    }
+
+private:
+    struct Entry
+    {
+        long long end_time = -1;
+        std::string text;
+    };
+
+    std::unordered_map<unsigned, Entry> entries_;
+};
+
+// Appends the list line for t ("Timer 3, expires in 0:04:59: tea", with
+// at given "Timer 3, expires in 0:04:59 (at 2026-10-15 08:00:00): tea")
+// to line, which is cleared first.
+inline void format_timer_line ( const Timer &t, Clock::time_point now, std::string &line,
+                                const std::string *at = nullptr )
+{
+    char remaining[ 32 ];
+    const auto length = parser::format_hms ( seconds_until ( t.get_deadline ( ), now ), remaining, sizeof remaining );
+    line.assign ( "Timer " );
+    line += std::to_string ( t.get_id ( ) );
+    line.append ( ", expires in " ).append ( remaining, length );
+    if ( at && !at->empty ( ) ) line.append ( " (at " ).append ( *at ).append ( ")" );
+    if ( t.get_cron ( ).valid ( ) ) {
+        line.append ( ", cron " ).append ( t.get_cron ( ).to_string ( ) );
+    } else if ( t.is_recurring ( ) ) {
+        const auto every = parser::format_hms ( seconds_until ( now + t.get_interval ( ), now ), remaining, sizeof remaining );
+        line.append ( ", repeats every " ).append ( remaining, every );
+    }
+    if ( t.has_target ( ) ) line.append ( ", to " ).append ( t.get_channel ( ) ).append ( " on " ).append ( t.get_network ( ) );
+    line.append ( ": " );
+    line.append ( t.get_reason ( ), t.get_reason_length ( ) );
+}
+
+#endif // ALARM_TIMER_CORE_H
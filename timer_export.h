@@ -0,0 +1,234 @@
+/*
+* JSON and CSV export of the alarm module's timers.
+* Copyright (c) 2017, Alexander Schwarz
+* License: BSD 3-clause License
+*
+* The output is written into one fixed buffer that is handed to a sink
+* whenever it fills up, so exporting a hundred thousand timers neither
+* allocates per timer nor ever has the whole document in memory.
+*/
+
+#ifndef ALARM_TIMER_EXPORT_H
+#define ALARM_TIMER_EXPORT_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "timer_core.h"
+
+enum class ExportFormat
+{
+    json,
+    csv
+};
+
+inline auto parse_export_format ( const std::string &name, ExportFormat &format ) -> bool
+{
+    if ( name == "json" ) format = ExportFormat::json;
+    else if ( name == "csv" ) format = ExportFormat::csv;
+    else return false;
+    return true;
+}
+
+inline auto export_content_type ( ExportFormat format ) -> const char*
+{
+    return format == ExportFormat::json ? "application/json" : "text/csv";
+}
+
+// Buffers output for sink ( const char *data, size_t length ), which is
+// called with every full buffer and, from finish, with the rest.
+template <typename Sink>
+class ExportWriter
+{
+public:
+    explicit ExportWriter ( Sink sink ) : sink_ ( sink ) { }
+    ExportWriter ( const ExportWriter& ) = delete;
+    auto operator= ( const ExportWriter& ) -> ExportWriter& = delete;
+
+    void put ( char c )
+    {
+        if ( used_ == sizeof buffer_ ) flush ( );
+        buffer_[ used_++ ] = c;
+    }
+    void put ( const char *text, size_t length )
+    {
+        while ( length > 0 ) {
+            if ( used_ == sizeof buffer_ ) flush ( );
+            const auto chunk = std::min ( length, sizeof buffer_ - used_ );
+            std::memcpy ( buffer_ + used_, text, chunk );
+            used_ += chunk;
+            text += chunk;
+            length -= chunk;
+        }
+    }
+    void put ( const char *text )
+    {
+        put ( text, std::strlen ( text ) );
+    }
+    void put_number ( long long value )
+    {
+        char digits[ 24 ];
+        const auto length = snprintf ( digits, sizeof digits, "%lld", value );
+        put ( digits, static_cast<size_t> ( length ) );
+    }
+    // A JSON string literal. Well-formed UTF-8 (which IRC text usually is)
+    // is passed through; any byte that doesn't start a complete, shortest
+    // form sequence of a scalar value becomes U+FFFD, so the document
+    // stays valid JSON whatever the reasons hold.
+    void put_json_string ( const char *text, size_t length )
+    {
+        static const char *const HEX = "0123456789abcdef";
+        put ( '"' );
+        for ( size_t i = 0; i < length; ) {
+            const auto c = static_cast<unsigned char> ( text[ i ] );
+            if ( c == '"' || c == '\\' ) {
+                put ( '\\' );
+                put ( static_cast<char> ( c ) );
+                ++i;
+            } else if ( c < 0x20 ) {
+                const char escape[] = { '\\', 'u', '0', '0', HEX[ c >> 4 ], HEX[ c & 15 ] };
+                put ( escape, sizeof escape );
+                ++i;
+            } else if ( c < 0x80 ) {
+                put ( static_cast<char> ( c ) );
+                ++i;
+            } else if ( const auto sequence = utf8_sequence ( text + i, length - i ) ) {
+                put ( text + i, sequence );
+                i += sequence;
+            } else {
+                put ( "\xef\xbf\xbd", 3 );
+                ++i;
+            }
+        }
+        put ( '"' );
+    }
+    // A CSV field, quoted (RFC 4180) only if it has to be.
+    void put_csv_field ( const char *text, size_t length )
+    {
+        if ( std::find_if ( text, text + length, [ ] ( char c ) {
+                 return c == ',' || c == '"' || c == '\r' || c == '\n';
+             } ) == text + length ) {
+            put ( text, length );
+            return;
+        }
+        put ( '"' );
+        for ( size_t i = 0; i < length; ++i ) {
+            if ( text[ i ] == '"' ) put ( '"' );
+            put ( text[ i ] );
+        }
+        put ( '"' );
+    }
+    // Hands what is left to the sink. Returns the bytes written in total.
+    auto finish ( ) -> size_t
+    {
+        flush ( );
+        return written_;
+    }
+
+private:
+    // Length of the well-formed multi-byte UTF-8 sequence at text, or 0.
+    // The ranges of the second byte rule out overlong forms, surrogates
+    // and anything above U+10FFFF (RFC 3629, section 4).
+    static auto utf8_sequence ( const char *text, size_t length ) -> size_t
+    {
+        const auto byte = [ text ] ( size_t i ) { return static_cast<unsigned char> ( text[ i ] ); };
+        const auto lead = byte ( 0 );
+        size_t size;
+        unsigned char low = 0x80, high = 0xbf;
+        if ( lead >= 0xc2 && lead <= 0xdf ) {
+            size = 2u;
+        } else if ( lead >= 0xe0 && lead <= 0xef ) {
+            size = 3u;
+            if ( lead == 0xe0 ) low = 0xa0;
+            if ( lead == 0xed ) high = 0x9f;
+        } else if ( lead >= 0xf0 && lead <= 0xf4 ) {
+            size = 4u;
+            if ( lead == 0xf0 ) low = 0x90;
+            if ( lead == 0xf4 ) high = 0x8f;
+        } else {
+            return 0u;
+        }
+        if ( length < size || byte ( 1 ) < low || byte ( 1 ) > high ) return 0u;
+        for ( size_t i = 2; i < size; ++i )
+            if ( byte ( i ) < 0x80 || byte ( i ) > 0xbf ) return 0u;
+        return size;
+    }
+    void flush ( )
+    {
+        if ( used_ == 0 ) return;
+        sink_ ( static_cast<const char*> ( buffer_ ), used_ );
+        written_ += used_;
+        used_ = 0u;
+    }
+
+    Sink sink_;
+    size_t used_ = 0u;
+    size_t written_ = 0u;
+    char buffer_[ 16384 ];
+};
+
+// Writes timers (a snapshot, in firing order) as one JSON object
+// {"timers":[{"id":3,"expires_at":...},...]} or as CSV with a header line.
+// expires_at is the wall-clock end time in Unix seconds as of wall_now;
+// remaining_ms and interval_ms are milliseconds, interval_ms 0 for timers
+// that don't repeat by interval. Returns the bytes written.
+template <typename Sink>
+auto export_timers ( const std::vector<Timer> &timers, Clock::time_point now, long long wall_now,
+                     ExportFormat format, Sink sink ) -> size_t
+{
+    ExportWriter<Sink> out ( sink );
+    const auto json = format == ExportFormat::json;
+    if ( json )
+        out.put ( "{\"timers\":[" );
+    else
+        out.put ( "id,expires_at,remaining_ms,interval_ms,cron,network,channel,reason\r\n" );
+    std::string cron;
+    for ( size_t i = 0; i < timers.size ( ); ++i ) {
+        const auto &timer = timers[ i ];
+        const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds> ( timer.get_deadline ( ) - now ).count ( );
+        const auto interval = std::chrono::duration_cast<std::chrono::milliseconds> ( timer.get_interval ( ) ).count ( );
+        cron = timer.get_cron ( ).valid ( ) ? timer.get_cron ( ).to_string ( ) : std::string ( );
+        if ( json ) {
+            out.put ( i == 0 ? "{\"id\":" : ",{\"id\":" );
+            out.put_number ( timer.get_id ( ) );
+            out.put ( ",\"expires_at\":" );
+            out.put_number ( wall_now + seconds_until ( timer.get_deadline ( ), now ) );
+            out.put ( ",\"remaining_ms\":" );
+            out.put_number ( remaining );
+            out.put ( ",\"interval_ms\":" );
+            out.put_number ( interval );
+            out.put ( ",\"cron\":" );
+            out.put_json_string ( cron.data ( ), cron.size ( ) );
+            out.put ( ",\"network\":" );
+            out.put_json_string ( timer.get_network_data ( ), timer.get_network_length ( ) );
+            out.put ( ",\"channel\":" );
+            out.put_json_string ( timer.get_channel_data ( ), timer.get_channel_length ( ) );
+            out.put ( ",\"reason\":" );
+            out.put_json_string ( timer.get_reason ( ), timer.get_reason_length ( ) );
+            out.put ( '}' );
+        } else {
+            out.put_number ( timer.get_id ( ) );
+            out.put ( ',' );
+            out.put_number ( wall_now + seconds_until ( timer.get_deadline ( ), now ) );
+            out.put ( ',' );
+            out.put_number ( remaining );
+            out.put ( ',' );
+            out.put_number ( interval );
+            out.put ( ',' );
+            out.put_csv_field ( cron.data ( ), cron.size ( ) );
+            out.put ( ',' );
+            out.put_csv_field ( timer.get_network_data ( ), timer.get_network_length ( ) );
+            out.put ( ',' );
+            out.put_csv_field ( timer.get_channel_data ( ), timer.get_channel_length ( ) );
+            out.put ( ',' );
+            out.put_csv_field ( timer.get_reason ( ), timer.get_reason_length ( ) );
+            out.put ( "\r\n" );
+        }
+    }
+    if ( json ) out.put ( "]}\n" );
+    return out.finish ( );
+}
+
+#endif // ALARM_TIMER_EXPORT_H
@@ -0,0 +1,189 @@
+/*
+* Process-wide expiry thread of the alarm module's thread backend.
+* Copyright (c) 2017, Alexander Schwarz
+* License: BSD 3-clause License
+*
+* The service knows nothing about ZNC: it runs TimerClients, which are
+* CAlarm modules in ZNC and simulated users in bench/timer_soak.cpp.
+*/
+
+#ifndef ALARM_TIMER_SERVICE_H
+#define ALARM_TIMER_SERVICE_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include "timer_core.h"
+
+// How many timers a client expires per turn before the next due client
+// gets its turn, so a burst of one user's timers can't delay everybody
+// else's.
+#ifndef ALARM_EXPIRY_BATCH
+#define ALARM_EXPIRY_BATCH 256u
+#endif
+
+// What TimerService calls back on its own thread. Both calls take the
+// client's own lock, and the client reports its earliest deadline back
+// with TimerService::schedule, from expire_timers at the latest.
+class TimerClient
+{
+public:
+    // Expires at most ALARM_EXPIRY_BATCH due timers.
+    virtual void expire_timers ( ) = 0;
+    // Applies the requests queued before TimerService::post.
+    virtual void drain_requests ( ) = 0;
+
+protected:
+    ~TimerClient ( ) = default;
+};
+
+// Each client registers its earliest deadline; the service sleeps until
+// the first one across all users and hands each due client back to itself.
+// Due clients take turns in ready_, each expiring at most
+// ALARM_EXPIRY_BATCH timers per turn before going to the back of the line;
+// while requests are posted too, a drain and an expiry turn alternate.
+// Lock order is the client's lock, then the service mutex_.
+class TimerService
+{
+public:
+    static auto instance ( ) -> TimerService&
+    {
+        static TimerService service;
+        return service;
+    }
+    // The first client to attach starts the thread, even while the one
+    // the last detach stopped is still winding down.
+    void attach ( TimerClient* )
+    {
+        std::lock_guard<std::mutex> lock ( mutex_ );
+        if ( clients_++ == 0 ) {
+            const auto generation = ++generation_;
+            thread_ = std::thread ( [ this, generation ] ( ) {
+                run ( generation );
+            } );
+        }
+    }
+    // Blocks until the service thread is no longer inside client, which is
+    // at most one batch of requests or expiries. The last detach wakes and
+    // joins the thread, so none of the client's code runs after, say, the
+    // module library gets unloaded. Any number of threads may detach
+    // different clients at the same time.
+    void detach ( TimerClient *client )
+    {
+        std::unique_lock<std::mutex> lock ( mutex_ );
+        // Keeps the client from rescheduling itself while we wait for it.
+        detaching_.insert ( client );
+        unschedule ( client );
+        pending_.erase ( std::remove ( pending_.begin ( ), pending_.end ( ), client ), pending_.end ( ) );
+        ready_.erase ( std::remove ( ready_.begin ( ), ready_.end ( ), client ), ready_.end ( ) );
+        idle_.wait ( lock, [ this, client ] ( ) {
+            return current_ != client;
+        } );
+        detaching_.erase ( client );
+        if ( --clients_ > 0 ) return;
+        ++generation_;
+        auto stopping = std::move ( thread_ );
+        lock.unlock ( );
+        wakeup_.notify_all ( );
+        if ( stopping.joinable ( ) ) stopping.join ( );
+    }
+    // Asks the service thread to run client->drain_requests ( ).
+    void post ( TimerClient *client )
+    {
+        {
+            std::lock_guard<std::mutex> lock ( mutex_ );
+            if ( detaching_.count ( client ) ) return;
+            pending_.push_back ( client );
+        }
+        wakeup_.notify_one ( );
+    }
+    // NO_DEADLINE means the client has nothing left to wait for.
+    void schedule ( TimerClient *client, Clock::time_point deadline )
+    {
+        std::lock_guard<std::mutex> lock ( mutex_ );
+        const auto old_front = deadlines_.empty ( ) ? NO_DEADLINE : deadlines_.begin ( )->first;
+        unschedule ( client );
+        // Keeps its turn; expire_timers reschedules it once it ran.
+        if ( deadline == NO_DEADLINE || detaching_.count ( client ) || std::find ( ready_.begin ( ), ready_.end ( ), client ) != ready_.end ( ) ) return;
+        scheduled_[ client ] = deadlines_.emplace ( deadline, client ).first;
+        if ( deadline < old_front ) wakeup_.notify_one ( );
+    }
+
+private:
+    using Deadlines = std::set<std::pair<Clock::time_point, TimerClient*>>;
+
+    TimerService ( ) = default;
+    void unschedule ( TimerClient *client )
+    {
+        auto it = scheduled_.find ( client );
+        if ( it == scheduled_.end ( ) ) return;
+        deadlines_.erase ( it->second );
+        scheduled_.erase ( it );
+    }
+    // Runs until the last detach starts another generation.
+    void run ( unsigned long long generation )
+    {
+        std::unique_lock<std::mutex> lock ( mutex_ );
+        while ( generation == generation_ ) {
+            bool expire = false;
+            const auto now = Clock::now ( );
+            while ( !deadlines_.empty ( ) && deadlines_.begin ( )->first <= now ) {
+                ready_.push_back ( deadlines_.begin ( )->second );
+                unschedule ( ready_.back ( ) );
+            }
+            // With both waiting, requests and expiries take turns, so a flood
+            // of commands can't hold expiries back or the other way round.
+            if ( !ready_.empty ( ) && ( pending_.empty ( ) || ready_turn_ ) ) {
+                current_ = ready_.front ( );
+                ready_.pop_front ( );
+                expire = true;
+                ready_turn_ = false;
+            } else if ( !pending_.empty ( ) ) {
+                current_ = pending_.front ( );
+                pending_.pop_front ( );
+                ready_turn_ = true;
+            } else if ( deadlines_.empty ( ) ) {
+                wakeup_.wait ( lock );
+                continue;
+            } else {
+                // Copied: detach may erase the entry while we wait.
+                const auto deadline = deadlines_.begin ( )->first;
+                wakeup_.wait_until ( lock, deadline );
+                continue;
+            }
+            lock.unlock ( );
+            if ( expire )
+                current_->expire_timers ( );
+            else
+                current_->drain_requests ( );
+            lock.lock ( );
+            current_ = nullptr;
+            idle_.notify_all ( );
+        }
+        // A wakeup meant for the next generation's thread may have been ours.
+        wakeup_.notify_all ( );
+    }
+
+    std::mutex mutex_{};
+    std::condition_variable wakeup_{};
+    std::condition_variable idle_{};
+    Deadlines deadlines_;
+    std::map<TimerClient*, Deadlines::iterator> scheduled_;
+    std::deque<TimerClient*> pending_;
+    std::deque<TimerClient*> ready_;
+    TimerClient *current_ = nullptr;
+    // Clients that a detach is waiting for; they can't be queued again.
+    std::set<TimerClient*> detaching_;
+    // Whether ready_ goes next when pending_ has requests too.
+    bool ready_turn_ = false;
+    unsigned clients_ = 0u;
+    unsigned long long generation_ = 0u;
+    std::thread thread_;
+};
+
+#endif // ALARM_TIMER_SERVICE_H
@@ -0,0 +1,174 @@
+/*
+* Ring buffer of timed events, for finding out where the alarm module
+* spends its time.
+* Copyright (c) 2017, Alexander Schwarz
+* License: BSD 3-clause License
+*
+* The probes are only compiled in with -DALARM_TRACE. Without it TraceRing
+* is empty and ALARM_TRACE_SCOPE expands to nothing. Compiled in but
+* switched off, a probe costs one relaxed load; switched on, two TSC reads
+* and three relaxed stores into the ring, which keeps the last CAPACITY
+* events and overwrites older ones.
+*/
+
+#ifndef ALARM_TRACE_H
+#define ALARM_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum class TraceKind : uint8_t
+{
+    lock_wait,
+    lock_hold,
+    parse,      // arg: length of the parsed text
+    add,
+    remove,
+    list,       // arg: page size
+    apply,      // arg: TimerRequest::Kind
+    expire,
+    put,        // arg: expired timers announced
+    deliver,
+    count
+};
+
+inline auto trace_kind_name ( TraceKind kind ) -> const char*
+{
+    static const char *const names[] = { "lock_wait", "lock_hold", "parse", "add", "remove",
+                                         "list", "apply", "expire", "put", "deliver" };
+    return kind < TraceKind::count ? names[ static_cast<size_t> ( kind ) ] : "?";
+}
+
+// Time stamp counter where there is one, steady_clock nanoseconds elsewhere.
+inline auto trace_ticks ( ) -> uint64_t
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc ( );
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds> (
+        std::chrono::steady_clock::now ( ).time_since_epoch ( ) ).count ( );
+#endif
+}
+
+class TraceRing
+{
+public:
+    static constexpr size_t CAPACITY = 4096u;
+
+#ifdef ALARM_TRACE
+    static constexpr bool compiled_in = true;
+
+    auto enabled ( ) const -> bool
+    {
+        return enabled_.load ( std::memory_order_relaxed );
+    }
+    // Only called from one thread, like dump.
+    void enable ( bool on )
+    {
+        if ( on && !enabled ( ) ) {
+            start_ticks_ = trace_ticks ( );
+            start_time_ = std::chrono::steady_clock::now ( );
+        }
+        enabled_.store ( on, std::memory_order_relaxed );
+    }
+    // May be called from any thread. A dump running at the same time can
+    // see an event half written, which is fine for a debugging aid.
+    void record ( TraceKind kind, uint64_t begin, uint64_t end, uint32_t arg )
+    {
+        auto &event = events_[ head_.fetch_add ( 1u, std::memory_order_relaxed ) % CAPACITY ];
+        event.begin.store ( begin, std::memory_order_relaxed );
+        event.ticks.store ( end - begin, std::memory_order_relaxed );
+        event.info.store ( static_cast<uint64_t> ( kind ) << 32 | arg, std::memory_order_relaxed );
+    }
+    // Calls emit ( line ) for every event still in the ring, oldest first,
+    // with times in microseconds since tracing was switched on. Returns the
+    // number of events.
+    template <typename Emit>
+    auto dump ( Emit emit ) const -> size_t
+    {
+        const auto elapsed = std::chrono::duration<double, std::micro> ( std::chrono::steady_clock::now ( ) - start_time_ );
+        const auto ticks = trace_ticks ( ) - start_ticks_;
+        const auto us_per_tick = ticks > 0 ? elapsed.count ( ) / ticks : 0.0;
+        const auto head = head_.load ( std::memory_order_relaxed );
+        char line[ 96 ];
+        for ( auto n = head > CAPACITY ? head - CAPACITY : 0u; n < head; ++n ) {
+            const auto &event = events_[ n % CAPACITY ];
+            const auto info = event.info.load ( std::memory_order_relaxed );
+            const auto begin = static_cast<int64_t> ( event.begin.load ( std::memory_order_relaxed ) - start_ticks_ );
+            snprintf ( line, sizeof line, "%14.3f %-9s %12.3f %u", begin * us_per_tick,
+                       trace_kind_name ( static_cast<TraceKind> ( info >> 32 ) ),
+                       event.ticks.load ( std::memory_order_relaxed ) * us_per_tick,
+                       static_cast<unsigned> ( info & 0xffffffffu ) );
+            emit ( static_cast<const char*> ( line ) );
+        }
+        return head > CAPACITY ? CAPACITY : head;
+    }
+
+private:
+    struct Event
+    {
+        std::atomic<uint64_t> begin { 0u };
+        std::atomic<uint64_t> ticks { 0u };
+        std::atomic<uint64_t> info { 0u };    // kind << 32 | arg
+    };
+
+    std::atomic<bool> enabled_ { false };
+    std::atomic<uint64_t> head_ { 0u };
+    uint64_t start_ticks_ = 0u;
+    std::chrono::steady_clock::time_point start_time_;
+    Event events_[ CAPACITY ];
+#else
+    static constexpr bool compiled_in = false;
+
+    constexpr auto enabled ( ) const -> bool
+    {
+        return false;
+    }
+    void enable ( bool ) { }
+    void record ( TraceKind, uint64_t, uint64_t, uint32_t ) { }
+    template <typename Emit>
+    auto dump ( Emit ) const -> size_t
+    {
+        return 0u;
+    }
+#endif
+};
+
+#ifdef ALARM_TRACE
+// Records the time from its construction to the end of its scope.
+class TraceScope
+{
+public:
+    TraceScope ( TraceRing &ring, TraceKind kind, uint32_t arg )
+        : ring_ ( ring.enabled ( ) ? &ring : nullptr ), kind_ ( kind ), arg_ ( arg )
+    {
+        if ( ring_ ) begin_ = trace_ticks ( );
+    }
+    TraceScope ( const TraceScope& ) = delete;
+    auto operator= ( const TraceScope& ) -> TraceScope& = delete;
+    ~TraceScope ( )
+    {
+        if ( ring_ ) ring_->record ( kind_, begin_, trace_ticks ( ), arg_ );
+    }
+
+private:
+    TraceRing *ring_;
+    TraceKind kind_;
+    uint32_t arg_;
+    uint64_t begin_ = 0u;
+};
+
+#define ALARM_TRACE_CONCAT_( a, b ) a##b
+#define ALARM_TRACE_NAME_( line ) ALARM_TRACE_CONCAT_( trace_scope_, line )
+#define ALARM_TRACE_SCOPE( ring, kind, arg ) \
+    TraceScope ALARM_TRACE_NAME_( __LINE__ ) ( ring, TraceKind::kind, static_cast<uint32_t> ( arg ) )
+#else
+#define ALARM_TRACE_SCOPE( ring, kind, arg ) do { } while ( false )
+#endif
+
+#endif // ALARM_TRACE_H